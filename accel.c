@@ -0,0 +1,672 @@
+/*
+*                       accel.c
+*
+*
+*   Summary: accel.c is the implementation for accel.h. accel.c holds the
+*            registry of known guest routines, the scan that fingerprints
+*            segment 0 and binds each routine's registers, and the native
+*            functions that stand in for the matched guest code.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#include <assert.h>
+#include <mem.h>
+
+#include "accel.h"
+#include "execute.h"
+#include "unpack.h"
+
+#define MAX_LENGTH 16
+#define NONE -1
+#define UNBOUND 8
+
+/*
+* Pattern variables. Each one stands for a guest register and is bound the
+* first time it is seen in a pattern. Distinct variables must be bound to
+* distinct registers.
+*/
+enum Var {
+    VAL = 0, SEG, DST, IDX, CNT, ONE, NEG1, TMP, ZERO, X, Y, Z, NUM_VARS
+};
+
+/*
+* What the value of an LV in a pattern has to be: V_EXIT is bound as the
+* exit label of a loop, V_START must be the index the routine starts at and
+* V_BYTE must fit in a character.
+*/
+enum Value_kind {
+    V_NONE = 0, V_EXIT, V_START, V_BYTE
+};
+
+typedef struct Pattern_op {
+    Um_opcode opcode;
+    int a, b, c;
+    int value;
+} Pattern_op;
+
+struct Match {
+    const struct Routine *routine;
+    uint32_t r[NUM_VARS];
+    uint32_t exit;
+    uint32_t byte;
+};
+
+struct Routine {
+    const char *name;
+    const Pattern_op *ops;
+    int length;
+    int writes;
+    uint64_t fingerprint;
+    uint64_t (*native)(Accel_T accel, struct Match *match, Seq_T segments,
+                       uint32_t *registers, int *counter, FILE *out);
+};
+
+struct Accel_T {
+    Accel_mode mode;
+    int length;
+    int matches;
+    struct Match **at;
+};
+
+/*
+* Both loops count CNT down and jump back to their start while it is not
+* zero. The register the body loads into is dead by then and holds the jump
+* target, which keeps the loops within the eight registers:
+*
+*       LV   VAL, exit
+*       LV   TMP, start
+*       CMOV VAL, TMP, CNT
+*       LOADP ZERO, VAL
+*
+* The copy loop copies words CNT - 1 down to 0 of SEG into DST, the output
+* loop writes CNT words of SEG from index IDX up.
+*/
+static const Pattern_op copy_loop_ops[] = {
+    { ADD,    CNT,  CNT,  NEG1, V_NONE  },
+    { SLOAD,  VAL,  SEG,  CNT,  V_NONE  },
+    { SSTORE, DST,  CNT,  VAL,  V_NONE  },
+    { LV,     VAL,  NONE, NONE, V_EXIT  },
+    { LV,     TMP,  NONE, NONE, V_START },
+    { CMOV,   VAL,  TMP,  CNT,  V_NONE  },
+    { LOADP,  NONE, ZERO, VAL,  V_NONE  }
+};
+
+static const Pattern_op output_loop_ops[] = {
+    { SLOAD,  VAL,  SEG,  IDX,  V_NONE  },
+    { OUT,    NONE, NONE, VAL,  V_NONE  },
+    { ADD,    IDX,  IDX,  ONE,  V_NONE  },
+    { ADD,    CNT,  CNT,  NEG1, V_NONE  },
+    { LV,     VAL,  NONE, NONE, V_EXIT  },
+    { LV,     TMP,  NONE, NONE, V_START },
+    { CMOV,   VAL,  TMP,  CNT,  V_NONE  },
+    { LOADP,  NONE, ZERO, VAL,  V_NONE  }
+};
+
+static const Pattern_op output_byte_ops[] = {
+    { LV,     X,    NONE, NONE, V_BYTE  },
+    { OUT,    NONE, NONE, X,    V_NONE  }
+};
+
+static const Pattern_op and_ops[] = {
+    { NAND,   X,    Y,    Z,    V_NONE  },
+    { NAND,   X,    X,    X,    V_NONE  }
+};
+
+static const Pattern_op negate_ops[] = {
+    { NAND,   X,    Y,    Y,    V_NONE  },
+    { ADD,    X,    X,    ONE,  V_NONE  }
+};
+
+/*
+* Name: mapped
+* Summary: returns segment id, or NULL if id is not a mapped segment.
+*/
+static Seq_T mapped(Seq_T segments, uint32_t id)
+{
+    if (id >= (uint32_t) Seq_length(segments)) {
+        return NULL;
+    }
+    return (Seq_T) Seq_get(segments, id);
+}
+
+/*
+* Name: in_bounds
+* Summary: returns 1 if words first to first + count - 1 are all in segment.
+*/
+static int in_bounds(Seq_T segment, uint32_t first, uint32_t count)
+{
+    return (uint64_t) first + count <= (uint64_t) Seq_length(segment);
+}
+
+/*
+* Name: loop_ready
+* Summary: checks the run time conditions shared by both loops: ZERO and
+*          NEG1 hold 0 and ~0, and CNT is not zero (a loop entered with CNT
+*          at zero runs 2^32 times and is left to the interpreter).
+* Output: returns the number of times the loop body will run, or 0.
+*/
+static uint32_t loop_ready(struct Match *match, uint32_t *registers)
+{
+    if (registers[match -> r[ZERO]] != 0
+        || registers[match -> r[NEG1]] != ~(uint32_t) 0) {
+        return 0;
+    }
+    return registers[match -> r[CNT]];
+}
+
+/*
+* Name: finish_loop
+* Summary: leaves the loop registers and program counter as they are after
+*          the last LOADP has fallen through to the exit label.
+*/
+static void finish_loop(struct Match *match, uint32_t *registers,
+                        int *counter)
+{
+    registers[match -> r[CNT]] = 0;
+    registers[match -> r[VAL]] = match -> exit;
+    registers[match -> r[TMP]] = *counter;
+    *counter = match -> exit;
+}
+
+/*
+* Name: copy_loop
+* Summary: native block copy of the first count words of segment SEG into
+*          segment DST. Copies into segment 0 are left to the interpreter
+*          since they change the code being matched.
+*/
+static uint64_t copy_loop(Accel_T accel, struct Match *match, Seq_T segments,
+                          uint32_t *registers, int *counter, FILE *out)
+{
+    (void) accel;
+    (void) out;
+
+    uint32_t count = loop_ready(match, registers);
+    uint32_t dst = registers[match -> r[DST]];
+    Seq_T from = mapped(segments, registers[match -> r[SEG]]);
+    Seq_T to = mapped(segments, dst);
+
+    if (count == 0 || dst == 0 || from == NULL || to == NULL
+        || !in_bounds(from, 0, count) || !in_bounds(to, 0, count)) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        Seq_put(to, i, Seq_get(from, i));
+    }
+
+    finish_loop(match, registers, counter);
+    return (uint64_t) count * match -> routine -> length;
+}
+
+/*
+* Name: output_loop
+* Summary: native string output. Writes count words of segment SEG starting
+*          at index IDX to out in batches. ONE must hold 1 and every word is
+*          checked to be a character before anything is written.
+*/
+static uint64_t output_loop(Accel_T accel, struct Match *match,
+                            Seq_T segments, uint32_t *registers, int *counter,
+                            FILE *out)
+{
+    (void) accel;
+
+    uint32_t count = loop_ready(match, registers);
+    uint32_t first = registers[match -> r[IDX]];
+    Seq_T from = mapped(segments, registers[match -> r[SEG]]);
+
+    if (count == 0 || registers[match -> r[ONE]] != 1 || from == NULL
+        || !in_bounds(from, first, count)) {
+        return 0;
+    }
+    for (uint32_t i = first; i < first + count; i++) {
+        if ((uint32_t) (uintptr_t) Seq_get(from, i) > 255) {
+            return 0;
+        }
+    }
+
+    char buffer[BUFSIZ];
+    size_t used = 0;
+    for (uint32_t i = first; i < first + count; i++) {
+        buffer[used++] = (char) (uintptr_t) Seq_get(from, i);
+        if (used == sizeof(buffer)) {
+            fwrite(buffer, 1, used, out);
+            used = 0;
+        }
+    }
+    fwrite(buffer, 1, used, out);
+
+    registers[match -> r[IDX]] += count;
+    finish_loop(match, registers, counter);
+    return (uint64_t) count * match -> routine -> length;
+}
+
+/*
+* Name: output_bytes
+* Summary: native output of a straight run of "LV X, c; OUT X" pairs. Every
+*          following pair that also matched is joined into one write.
+*/
+static uint64_t output_bytes(Accel_T accel, struct Match *match,
+                             Seq_T segments, uint32_t *registers, int *counter,
+                             FILE *out)
+{
+    (void) segments;
+
+    char buffer[BUFSIZ];
+    size_t used = 0;
+    uint64_t steps = 0;
+    int pc = *counter;
+
+    while (pc < accel -> length && accel -> at[pc] != NULL
+           && accel -> at[pc] -> routine == match -> routine) {
+        struct Match *curr = accel -> at[pc];
+        registers[curr -> r[X]] = curr -> byte;
+        buffer[used++] = (char) curr -> byte;
+        if (used == sizeof(buffer)) {
+            fwrite(buffer, 1, used, out);
+            used = 0;
+        }
+        pc += curr -> routine -> length;
+        steps += curr -> routine -> length;
+    }
+    fwrite(buffer, 1, used, out);
+
+    *counter = pc;
+    return steps;
+}
+
+/*
+* Name: and_helper
+* Summary: native bitwise and, which the guest builds from two NANDs.
+*/
+static uint64_t and_helper(Accel_T accel, struct Match *match, Seq_T segments,
+                           uint32_t *registers, int *counter, FILE *out)
+{
+    (void) accel;
+    (void) segments;
+    (void) out;
+
+    registers[match -> r[X]] = registers[match -> r[Y]]
+                               & registers[match -> r[Z]];
+    *counter += match -> routine -> length;
+    return match -> routine -> length;
+}
+
+/*
+* Name: negate_helper
+* Summary: native two's complement negation (NOT then add one). ONE must
+*          hold 1 at run time.
+*/
+static uint64_t negate_helper(Accel_T accel, struct Match *match,
+                              Seq_T segments, uint32_t *registers,
+                              int *counter, FILE *out)
+{
+    (void) accel;
+    (void) segments;
+    (void) out;
+
+    if (registers[match -> r[ONE]] != 1) {
+        return 0;
+    }
+    registers[match -> r[X]] = -registers[match -> r[Y]];
+    *counter += match -> routine -> length;
+    return match -> routine -> length;
+}
+
+#define ROUTINE(name, ops, writes, native) \
+    { name, ops, sizeof(ops) / sizeof(ops[0]), writes, 0, native }
+
+/*
+* The registry. Each routine names the variable holding the one segment it
+* writes, if any. Longer routines come first so they win over the short
+* helpers that could match inside them.
+*/
+static struct Routine registry[] = {
+    ROUTINE("copy loop",   copy_loop_ops,   DST,  copy_loop),
+    ROUTINE("output loop", output_loop_ops, NONE, output_loop),
+    ROUTINE("output byte", output_byte_ops, NONE, output_bytes),
+    ROUTINE("and",         and_ops,         NONE, and_helper),
+    ROUTINE("negate",      negate_ops,      NONE, negate_helper)
+};
+
+static const int num_routines = sizeof(registry) / sizeof(registry[0]);
+
+/*
+* Name: fingerprint_ops
+* Summary: packs the opcodes of a pattern four bits each, first opcode in the
+*          lowest bits, the same way the scan packs a window of segment 0.
+*/
+static uint64_t fingerprint_ops(const Pattern_op *ops, int length)
+{
+    uint64_t fingerprint = 0;
+    for (int i = length - 1; i >= 0; i--) {
+        fingerprint = (fingerprint << 4) | ops[i].opcode;
+    }
+    return fingerprint;
+}
+
+static uint64_t length_mask(int length)
+{
+    return length >= MAX_LENGTH ? ~(uint64_t) 0
+                                : ((uint64_t) 1 << (4 * length)) - 1;
+}
+
+/*
+* Name: bind
+* Summary: binds pattern variable var to register reg, or checks that it
+*          is already bound to reg. owner records which variable holds each
+*          register so no two variables share one.
+* Output: returns 1 if the binding is consistent, 0 otherwise.
+*/
+static int bind(struct Match *match, int *owner, int var, uint32_t reg)
+{
+    if (var == NONE) {
+        return 1;
+    }
+    if (match -> r[var] == UNBOUND) {
+        if (owner[reg] != NONE) {
+            return 0;
+        }
+        match -> r[var] = reg;
+        owner[reg] = var;
+        return 1;
+    }
+    return match -> r[var] == reg;
+}
+
+/*
+* Name: match_routine
+* Summary: matches the operands of routine against the decoded instructions
+*          starting at index start. The opcodes have already been matched by
+*          fingerprint.
+* Output: returns a new Match, or NULL if the operands do not fit.
+*/
+static struct Match *match_routine(const struct Routine *routine,
+                                   struct Instruction *code, int start)
+{
+    struct Match *match;
+    NEW(match);
+    assert(match != NULL);
+
+    int owner[8];
+    for (int i = 0; i < 8; i++) {
+        owner[i] = NONE;
+    }
+    for (int i = 0; i < NUM_VARS; i++) {
+        match -> r[i] = UNBOUND;
+    }
+    match -> routine = routine;
+    match -> exit = 0;
+    match -> byte = 0;
+
+    for (int i = 0; i < routine -> length; i++) {
+        const Pattern_op *op = &routine -> ops[i];
+        struct Instruction *curr = &code[start + i];
+        int ok = bind(match, owner, op -> a, curr -> rA)
+                 && bind(match, owner, op -> b, curr -> rB)
+                 && bind(match, owner, op -> c, curr -> rC);
+
+        if (ok && op -> value == V_EXIT) {
+            match -> exit = curr -> value;
+        } else if (ok && op -> value == V_START) {
+            ok = curr -> value == (uint32_t) start;
+        } else if (ok && op -> value == V_BYTE) {
+            ok = curr -> value <= 255;
+            match -> byte = curr -> value;
+        }
+
+        if (!ok) {
+            FREE(match);
+            return NULL;
+        }
+    }
+    return match;
+}
+
+/*
+* Name: forget
+* Summary: frees every match in the table.
+*/
+static void forget(Accel_T accel)
+{
+    for (int i = 0; i < accel -> length; i++) {
+        if (accel -> at[i] != NULL) {
+            FREE(accel -> at[i]);
+        }
+    }
+    if (accel -> at != NULL) {
+        FREE(accel -> at);
+    }
+    accel -> length = 0;
+    accel -> matches = 0;
+}
+
+/*
+* Name: accel_new
+* Summary: creates an empty routine table and fingerprints the registry.
+* Input: mode is the mode the table is used in.
+* Output: returns the new table.
+* Side Effects: allocates memory for the table.
+* Error Conditions: CRE if not enough memory.
+*/
+Accel_T accel_new(Accel_mode mode)
+{
+    Accel_T accel;
+    NEW(accel);
+    assert(accel != NULL);
+
+    accel -> mode = mode;
+    accel -> length = 0;
+    accel -> matches = 0;
+    accel -> at = NULL;
+
+    for (int i = 0; i < num_routines; i++) {
+        assert(registry[i].length <= MAX_LENGTH);
+        registry[i].fingerprint = fingerprint_ops(registry[i].ops,
+                                                  registry[i].length);
+    }
+    return accel;
+}
+
+/*
+* Name: accel_free
+* Summary: frees the table and all of its matches.
+* Input: accel is a pointer to a valid non null Accel_T.
+* Output: N/A
+* Side Effects: *accel is freed and set to NULL.
+* Error Conditions: CRE if accel or *accel is NULL.
+*/
+void accel_free(Accel_T *accel)
+{
+    assert(accel != NULL && *accel != NULL);
+    forget(*accel);
+    FREE(*accel);
+}
+
+Accel_mode accel_mode(Accel_T accel)
+{
+    assert(accel != NULL);
+    return accel -> mode;
+}
+
+/*
+* Name: accel_scan
+* Summary: decodes segment 0, computes for every index a fingerprint of the
+*          opcodes of the next MAX_LENGTH instructions and, where a routine's
+*          fingerprint agrees, binds its operands. The first routine in the
+*          registry that matches at an index is recorded there.
+* Input: accel and seg0 are valid non null.
+* Output: N/A
+* Side Effects: previous matches are freed.
+* Error Conditions: CRE if accel or seg0 is NULL, CRE if not enough memory.
+*/
+void accel_scan(Accel_T accel, Seq_T seg0)
+{
+    assert(accel != NULL && seg0 != NULL);
+    forget(accel);
+
+    int length = Seq_length(seg0);
+    accel -> length = length;
+    if (length == 0) {
+        return;
+    }
+    accel -> at = CALLOC(length, sizeof(struct Match *));
+
+    struct Instruction *code = CALLOC(length, sizeof(struct Instruction));
+    uint64_t *window = CALLOC(length, sizeof(uint64_t));
+    assert(accel -> at != NULL && code != NULL && window != NULL);
+
+    for (int i = 0; i < length; i++) {
+        Instruction curr = unpack((uint32_t) (uintptr_t) Seq_get(seg0, i));
+        code[i] = *curr;
+        FREE(curr);
+    }
+
+    uint64_t fingerprint = 0;
+    for (int i = length - 1; i >= 0; i--) {
+        fingerprint = (fingerprint << 4) | code[i].opcode;
+        window[i] = fingerprint;
+    }
+
+    for (int i = 0; i < length; i++) {
+        for (int j = 0; j < num_routines; j++) {
+            const struct Routine *routine = &registry[j];
+            if (i + routine -> length > length
+                || (window[i] & length_mask(routine -> length))
+                   != routine -> fingerprint) {
+                continue;
+            }
+            accel -> at[i] = match_routine(routine, code, i);
+            if (accel -> at[i] != NULL) {
+                accel -> matches++;
+                break;
+            }
+        }
+    }
+
+    FREE(code);
+    FREE(window);
+}
+
+/*
+* Name: accel_invalidate
+* Summary: drops every match whose instructions include index.
+* Input: accel is valid non null, index is a word of segment 0.
+* Output: N/A
+* Side Effects: frees the dropped matches.
+* Error Conditions: CRE if accel is NULL.
+*/
+void accel_invalidate(Accel_T accel, uint32_t index)
+{
+    assert(accel != NULL);
+    if (accel -> matches == 0 || index >= (uint32_t) accel -> length) {
+        return;
+    }
+
+    int first = (int) index - MAX_LENGTH + 1;
+    for (int i = first < 0 ? 0 : first; i <= (int) index; i++) {
+        struct Match *curr = accel -> at[i];
+        if (curr != NULL && i + curr -> routine -> length > (int) index) {
+            FREE(accel -> at[i]);
+            accel -> matches--;
+        }
+    }
+}
+
+int accel_matches(Accel_T accel, int counter)
+{
+    assert(accel != NULL);
+    return counter >= 0 && counter < accel -> length
+           && accel -> at[counter] != NULL;
+}
+
+/*
+* Name: accel_run
+* Summary: runs the native routine matched at *counter.
+* Input: accel, segments, registers and counter are valid non null, out is
+*        the stream guest output goes to.
+* Output: returns the number of guest instructions replaced, 0 if none.
+* Side Effects: registers, segments, out and *counter are updated as the
+*               interpreter would have updated them.
+* Error Conditions: CRE if accel is NULL.
+*/
+uint64_t accel_run(Accel_T accel, Seq_T segments, uint32_t *registers,
+                   int *counter, FILE *out)
+{
+    if (!accel_matches(accel, *counter)) {
+        return 0;
+    }
+
+    struct Match *match = accel -> at[*counter];
+    return match -> routine -> native(accel, match, segments, registers,
+                                      counter, out);
+}
+
+/*
+* Name: accel_save
+* Summary: copies the segment the routine matched at counter writes, so the
+*          routine can be run on the real machine and undone again.
+* Input: accel, segments, registers and id are valid non null, counter is an
+*        index with a match.
+* Output: returns the copy and sets *id to the segment it was taken from, or
+*         returns NULL if the routine writes no segment.
+* Side Effects: allocates memory for the copy.
+* Error Conditions: CRE if not enough memory.
+*/
+Seq_T accel_save(Accel_T accel, int counter, Seq_T segments,
+                 uint32_t *registers, uint32_t *id)
+{
+    assert(accel_matches(accel, counter) && segments != NULL && id != NULL);
+    struct Match *match = accel -> at[counter];
+    int writes = match -> routine -> writes;
+    if (writes == NONE) {
+        return NULL;
+    }
+
+    *id = registers[match -> r[writes]];
+    Seq_T curr = mapped(segments, *id);
+    if (curr == NULL) {
+        return NULL;
+    }
+
+    Seq_T copy = Seq_new(Seq_length(curr));
+    assert(copy != NULL);
+    for (int i = 0; i < Seq_length(curr); i++) {
+        Seq_addhi(copy, Seq_get(curr, i));
+    }
+    return copy;
+}
+
+/*
+* Name: accel_restore
+* Summary: puts a copy made by accel_save back in place of segment id.
+* Input: segments is valid non null, saved came from accel_save for id.
+* Output: returns the segment saved replaced.
+* Side Effects: segments is updated at id.
+* Error Conditions: CRE if segments or saved is NULL.
+*/
+Seq_T accel_restore(Seq_T segments, uint32_t id, Seq_T saved)
+{
+    assert(segments != NULL && saved != NULL);
+    return (Seq_T) Seq_put(segments, id, saved);
+}
+
+/*
+* Name: accel_same_segment
+* Summary: compares two segments word for word.
+* Input: a and b are valid non null.
+* Output: returns 1 if they are the same, 0 otherwise.
+*/
+int accel_same_segment(Seq_T a, Seq_T b)
+{
+    assert(a != NULL && b != NULL);
+    if (Seq_length(a) != Seq_length(b)) {
+        return 0;
+    }
+    for (int i = 0; i < Seq_length(a); i++) {
+        if (Seq_get(a, i) != Seq_get(b, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,109 @@
+/*
+*                       accel.h
+*
+*
+*   Summary: Interface for accel. accel fingerprints the code in segment 0,
+*            matches it against a registry of known guest routines (block
+*            copy loops, output loops, NAND helpers) and runs a native
+*            equivalent of a matched routine in place of the interpreter.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#ifndef ACCEL_READER
+#define ACCEL_READER
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "seq.h"
+
+/*
+* ACCEL_OFF interprets every instruction, ACCEL_ON runs native routines when
+* they match and ACCEL_VERIFY runs both and aborts if their effects differ.
+*/
+typedef enum Accel_mode {
+    ACCEL_OFF = 0, ACCEL_ON, ACCEL_VERIFY
+} Accel_mode;
+
+typedef struct Accel_T *Accel_T;
+
+/*
+* Name: accel_new
+* Usage: called by um() to create the routine table for a run.
+* Expected Input: mode is the mode the table is used in.
+*/
+extern Accel_T accel_new(Accel_mode mode);
+
+/*
+* Name: accel_free
+* Usage: frees the routine table and every match recorded in it.
+* Expected Input: accel is a pointer to a valid non null Accel_T.
+*/
+extern void accel_free(Accel_T *accel);
+
+/*
+* Name: accel_mode
+* Usage: returns the mode accel was created with.
+*/
+extern Accel_mode accel_mode(Accel_T accel);
+
+/*
+* Name: accel_scan
+* Usage: called when segment 0 is loaded and after every LOADP that replaces
+*        segment 0. Forgets all previous matches and fingerprints seg0.
+* Expected Input: accel and seg0 are valid non null.
+*/
+extern void accel_scan(Accel_T accel, Seq_T seg0);
+
+/*
+* Name: accel_invalidate
+* Usage: called when the guest stores into segment 0 at index. Drops every
+*        match whose code covers that index.
+*/
+extern void accel_invalidate(Accel_T accel, uint32_t index);
+
+/*
+* Name: accel_matches
+* Usage: returns 1 if a routine was matched at counter, 0 otherwise.
+*/
+extern int accel_matches(Accel_T accel, int counter);
+
+/*
+* Name: accel_run
+* Usage: runs the native routine matched at *counter, if there is one and its
+*        run time conditions hold. Registers, segments and output are updated
+*        exactly as the interpreter would update them and *counter is set to
+*        the next instruction to interpret.
+* Expected Input: segments, registers and counter are valid non null, out is
+*                 the stream guest output is written to.
+* Output: the number of guest instructions the routine stood in for, or 0 if
+*         nothing ran and the instruction at *counter must be interpreted.
+*/
+extern uint64_t accel_run(Accel_T accel, Seq_T segments, uint32_t *registers,
+                          int *counter, FILE *out);
+
+/*
+* Name: accel_save
+* Usage: used by ACCEL_VERIFY to copy the one segment the routine matched at
+*        counter writes before it runs. Sets *id to that segment.
+* Output: the copy, or NULL if the routine writes no segment.
+*/
+extern Seq_T accel_save(Accel_T accel, int counter, Seq_T segments,
+                        uint32_t *registers, uint32_t *id);
+
+/*
+* Name: accel_restore
+* Usage: puts a copy made by accel_save back at id and returns the segment
+*        it replaces.
+*/
+extern Seq_T accel_restore(Seq_T segments, uint32_t id, Seq_T saved);
+
+/*
+* Name: accel_same_segment
+* Usage: returns 1 if both segments hold the same words.
+*/
+extern int accel_same_segment(Seq_T a, Seq_T b);
+
+#endif
@@ -17,6 +17,7 @@
 #include <mem.h>
 #include <inttypes.h>
 #include <math.h>
+#include <string.h>
 
 const int hint = 16;
 
@@ -63,16 +64,18 @@ void load_value(uint32_t value, uint32_t *r)
 
 /*
 * Name: Output
-* Summary: ouptut writes the given value to standard output.
-* Input: value is an integer expected to be between 0 and 255.
-* Output: No return value but 'value' is pritned to standard output.
+* Summary: ouptut writes the given value to the output stream.
+* Input: out is the stream guest output goes to (standard output unless
+*        ACCEL_VERIFY is capturing it), value is an integer expected to be
+*        between 0 and 255.
+* Output: No return value but 'value' is pritned to out.
 * Side Effects: N/A
 * Error Conditions: CRE if given value is not between 0 and 255.
 */
-void output(int value)
+void output(FILE *out, int value)
 {
     assert(value >= 0 && value <= 255);
-    printf("%c", value);
+    putc(value, out);
 }
 
 /*
@@ -146,19 +149,20 @@ void cmov(uint32_t *rA, uint32_t rB, uint32_t rC)
 
 /*
 * Name: in
-* Summary: in accepts 1 character from standard input and updates register rC
-*          to be the inputted character. if the input is signalled to be end of
-*          input, rC is populated with a uint32_t of all 1s.
-* Input: rC is the address of register rC. a valid non null register address is
-*        expected.
+* Summary: in accepts 1 character from the guest's input and updates register
+*          rC to be the inputted character. if the input is signalled to be
+*          end of input, rC is populated with a uint32_t of all 1s.
+* Input: input is where the guest reads from (standard input unless the
+*        guest is served on a socket), rC is the address of register rC. a
+*        valid non null register address is expected.
 * Output: N/A
 * Side Effects: rC is updated by reference.
-* Error Conditions: CRE if rC is NULL.
+* Error Conditions: CRE if input or rC is NULL.
 */
-void in(uint32_t *rC)
+void in(Um_input *input, uint32_t *rC)
 {
-    assert(rC != NULL);
-    char c = getc(stdin);
+    assert(input != NULL && rC != NULL);
+    int c = input -> get(input -> cl);
     if (c != EOF) {
         *rC =  c;
     } else {
@@ -337,13 +341,14 @@ void loadp(Seq_T segments, uint32_t rB)
 *        current opcode and registers, segments is the sequence of segments,
 *        ids is the sequence of previously unmapped segment identifiers that
 *        can be reused, registers is a pointer to the 32 bit registers 0-7,
-*        and counter is a pointer to the program counter. 
+*        counter is a pointer to the program counter, input is where IN
+*        reads from and out is the stream guest output is written to.
 * Output: N/A
 * Side Effects: side effects of called function.
 * Error Conditions: error conditions of called funciton.
 */
 void execute(Instruction instruction, Seq_T segments, Seq_T ids,
-            uint32_t *registers, int *counter)
+            uint32_t *registers, int *counter, Um_input *input, FILE *out)
 {
 
     uint32_t opcode = instruction -> opcode;
@@ -401,11 +406,11 @@ void execute(Instruction instruction, Seq_T segments, Seq_T ids,
         case OUT:
         {
             int value = registers[instruction -> rC];
-            output(value);
+            output(out, value);
             break;
         }
         case IN:
-            in(&registers[instruction -> rC]);
+            in(input, &registers[instruction -> rC]);
             break;
         case LOADP:
 
@@ -422,63 +427,383 @@ void execute(Instruction instruction, Seq_T segments, Seq_T ids,
 }
 
 /*
-* Name: um
-* Summary: um is the function called by um.c in main. um takes in the read in
-*          segment 0, unpacks the instruction, and passes the instructions to
-*          execute(). these happen in a while loop that runs while the program
-*          counter is less than the size of segment 0
-* Input: segment 0 (sequence). expected to be a valid non-null Seq_T.
-* Output: N/A
-* Side Effects: Memory allocated for Seq_T 'segments' that holds all segments,
-*               memory allocated and free'd for instances of
-*               Instruction struct, and memory allocated for Sequence
-*               of unmapped identifiers. Function that frees memory for
-*               unmapped identifiers and segments called here.
-*
-* Error Conditions: CRE if seg0 is null. all error conditions of called opcode
-*                   instructions apply.
+* Name: step
+* Summary: step unpacks and executes the instruction at the program counter
+*          and keeps the routine table in line with segment 0: it is scanned
+*          again after a LOADP replaces segment 0 and matches are dropped
+*          when the guest stores into segment 0.
+* Input: segments, ids, registers and counter are as for execute(), accel is
+*        the routine table or NULL when acceleration is off, perf is the
+*        counters or NULL when --perf is off, metrics is the shared block or
+*        NULL when --stats is off, input is where IN reads from and out is
+*        the stream guest output goes to.
+* Output: returns UM_HALTED if the instruction was HALT, UM_BLOCKED if it
+*         was an IN with no byte ready (nothing is done or counted and the
+*         program counter stays on the IN), UM_RUNNING otherwise.
+* Side Effects: side effects of the executed instruction.
+* Error Conditions: error conditions of the executed instruction.
 */
-void um(Seq_T seg0)
+Um_status step(Seq_T segments, Seq_T ids, uint32_t *registers, int *counter,
+               Accel_T accel, Perfctr_T perf, Metrics_T metrics,
+               Um_input *input, FILE *out)
 {
-    assert(seg0 != NULL);
+    uint32_t word = (uint32_t) (uintptr_t) Seq_get(Seq_get(segments, 0),
+                                                   *counter);
+    Instruction instructions = unpack(word);
 
-    Seq_T segments = Seq_new(hint);
-    assert(segments != NULL);
+    if (instructions -> opcode == IN && !input -> ready(input -> cl)) {
+        FREE(instructions);
+        return UM_BLOCKED;
+    }
 
-    Seq_addhi(segments, seg0);
+    if (perf != NULL) {
+        perfctr_count(perf, *counter, instructions -> opcode);
+    }
+    if (metrics != NULL) {
+        metrics_step(metrics, *counter, 1);
+    }
 
-    // reusable identifiers
-    Seq_T ids = Seq_new(1);
-    assert(ids != NULL);
+    if (instructions -> opcode == HALT) {
+        FREE(instructions);
+        return UM_HALTED;
+    }
+
+    uint32_t loaded = registers[instructions -> rB];
+    uint32_t stored = registers[instructions -> rA];
+    uint32_t index = registers[instructions -> rB];
+    uint32_t size = registers[instructions -> rC];
+    int64_t seg0_words = 0;
+    uint64_t unmapped = 0;
+
+    if (metrics != NULL && instructions -> opcode == LOADP) {
+        seg0_words = Seq_length(Seq_get(segments, 0));
+    }
+    if (metrics != NULL && instructions -> opcode == INACTIVATE
+        && size < (uint32_t) Seq_length(segments)
+        && Seq_get(segments, size) != NULL) {
+        unmapped = Seq_length(Seq_get(segments, size));
+    }
+    if (metrics != NULL && instructions -> opcode == IN) {
+        metrics_state(metrics, METRICS_WAITING_INPUT);
+    }
+
+    execute(instructions, segments, ids, registers, counter, input, out);
+
+    if (instructions -> opcode != LOADP) {
+        (*counter)++;
+    }
+
+    if (perf != NULL && instructions -> opcode == LOADP && loaded != 0) {
+        perfctr_load(perf);
+    }
+    if (metrics != NULL) {
+        if (instructions -> opcode == ACTIVATE) {
+            metrics_map(metrics, size);
+        } else if (instructions -> opcode == INACTIVATE) {
+            metrics_unmap(metrics, unmapped);
+        } else if (instructions -> opcode == IN) {
+            metrics_state(metrics, METRICS_RUNNING);
+        } else if (instructions -> opcode == LOADP && loaded != 0) {
+            metrics_load(metrics, Seq_length(Seq_get(segments, 0))
+                                  - seg0_words);
+        }
+    }
+    if (accel != NULL) {
+        if (instructions -> opcode == LOADP && loaded != 0) {
+            accel_scan(accel, Seq_get(segments, 0));
+        } else if (instructions -> opcode == SSTORE && stored == 0) {
+            accel_invalidate(accel, index);
+        }
+    }
+
+    FREE(instructions);
+    return UM_RUNNING;
+}
 
-    uint32_t *registers = malloc(8 * sizeof(uint32_t));
-    assert(registers != NULL);
+/*
+* Name: verify
+* Summary: verify runs the native routine matched at the program counter,
+*          undoes it, then interprets the same number of guest instructions
+*          and checks that registers, program counter, output and the
+*          segment the routine writes all agree. That segment is copied each
+*          time, so this is for testing only.
+* Input: as for step().
+* Output: returns the number of guest instructions the routine stood in
+*         for, or 0 if the instruction at the program counter must be
+*         interpreted as usual.
+* Side Effects: the machine advances past the routine and its output is
+*               written to out.
+* Error Conditions: exits with EXIT_FAILURE if the two runs disagree.
+*/
+uint64_t verify(Seq_T segments, Seq_T ids, uint32_t *registers,
+                int *counter, Accel_T accel, Perfctr_T perf,
+                Metrics_T metrics, Um_input *input, FILE *out)
+{
+    if (!accel_matches(accel, *counter)) {
+        return 0;
+    }
 
+    uint32_t id = 0;
+    Seq_T saved = accel_save(accel, *counter, segments, registers, &id);
+    uint32_t native_registers[8];
+    int native_counter = *counter;
     for (int i = 0; i < 8; i++) {
-        registers[i] = 0;
+        native_registers[i] = registers[i];
     }
 
-    int counter = 0;
-    while (counter < Seq_length(Seq_get(segments, 0))) {
+    char *native_buf, *interp_buf;
+    size_t native_len, interp_len;
+    FILE *native_out = open_memstream(&native_buf, &native_len);
+    assert(native_out != NULL);
 
-        uint32_t word = (uint32_t) (uintptr_t) Seq_get(Seq_get(segments, 0),
-                                                       counter);
-        Instruction instructions = unpack(word);
+    uint64_t steps = accel_run(accel, segments, native_registers,
+                               &native_counter, native_out);
+    fclose(native_out);
 
-        if (instructions -> opcode == HALT) {
-            FREE(instructions);
-            break;
+    Seq_T native_seg = NULL;
+    if (saved != NULL) {
+        native_seg = accel_restore(segments, id, saved);
+    }
+
+    if (steps == 0) {
+        free(native_buf);
+        if (native_seg != NULL) {
+            Seq_free(&native_seg);
+        }
+        return 0;
+    }
+
+    int start = *counter;
+    FILE *interp_out = open_memstream(&interp_buf, &interp_len);
+    assert(interp_out != NULL);
+    for (uint64_t i = 0; i < steps; i++) {
+        step(segments, ids, registers, counter, accel, perf, metrics,
+             input, interp_out);
+    }
+    fclose(interp_out);
+
+    int same = *counter == native_counter && native_len == interp_len
+               && memcmp(native_buf, interp_buf, native_len) == 0;
+    for (int i = 0; i < 8; i++) {
+        same = same && registers[i] == native_registers[i];
+    }
+    if (native_seg != NULL) {
+        same = same && accel_same_segment(native_seg,
+                                          Seq_get(segments, id));
+        Seq_free(&native_seg);
+    }
+    if (!same) {
+        fprintf(stderr, "Native routine at %d does not match the "
+                        "interpreter\n", start);
+        exit(EXIT_FAILURE);
+    }
+
+    fwrite(interp_buf, 1, interp_len, out);
+    free(native_buf);
+    free(interp_buf);
+    return steps;
+}
+
+struct Um_T {
+    Seq_T segments;
+    Seq_T ids;
+    uint32_t registers[8];
+    int counter;
+    int halted;
+    Accel_mode mode;
+    Accel_T accel;
+    Perfctr_T perf;
+    Metrics_T metrics;
+    Um_input input;
+    FILE *out;
+};
+
+/*
+* Name: um_new
+* Summary: um_new creates a guest around the read in segment 0 with all
+*          registers 0 and the program counter at the start of segment 0,
+*          and starts the counters and the shared block if they are on.
+* Input: seg0 is a valid non-null Seq_T, mode, perf and metrics are as for
+*        um(), input is where IN reads from and out is where OUT writes to.
+* Output: returns the new Um_T.
+* Side Effects: Memory allocated for the guest and its Seq_T 'segments' and
+*               sequence of unmapped identifiers.
+* Error Conditions: CRE if seg0 or out is null or not enough memory.
+*/
+Um_T um_new(Seq_T seg0, Accel_mode mode, Perfctr_T perf, Metrics_T metrics,
+            Um_input input, FILE *out)
+{
+    assert(seg0 != NULL && out != NULL);
+    Um_T um;
+    NEW0(um);
+    assert(um != NULL);
+
+    um -> segments = Seq_new(hint);
+    assert(um -> segments != NULL);
+    Seq_addhi(um -> segments, seg0);
+
+    // reusable identifiers
+    um -> ids = Seq_new(1);
+    assert(um -> ids != NULL);
+
+    um -> mode = mode;
+    um -> perf = perf;
+    um -> metrics = metrics;
+    um -> input = input;
+    um -> out = out;
+
+    if (mode != ACCEL_OFF) {
+        um -> accel = accel_new(mode);
+        accel_scan(um -> accel, seg0);
+    }
+
+    if (perf != NULL) {
+        perfctr_start(perf);
+    }
+    if (metrics != NULL) {
+        metrics_map(metrics, Seq_length(seg0));
+        metrics_state(metrics, METRICS_RUNNING);
+    }
+    return um;
+}
+
+/*
+* Name: halt
+* Summary: stops the counters and publishes the halted guest.
+*/
+static Um_status halt(Um_T um)
+{
+    um -> halted = 1;
+    if (um -> perf != NULL) {
+        perfctr_stop(um -> perf);
+    }
+    if (um -> metrics != NULL) {
+        metrics_step(um -> metrics, um -> counter, 0);
+        metrics_state(um -> metrics, METRICS_HALTED);
+    }
+    return UM_HALTED;
+}
+
+/*
+* Name: um_run
+* Summary: um_run unpacks the instruction at the program counter and passes
+*          it to execute(), or runs a matched routine natively, in a while
+*          loop that runs while the program counter is less than the size of
+*          segment 0, until the guest halts, blocks on IN or has run budget
+*          instructions.
+* Input: um is a valid non-null Um_T, budget is the most guest instructions
+*        to run, or 0 for no limit. A native routine counts as the
+*        instructions it stands in for and is never cut short, so a guest
+*        may overrun its budget by one routine.
+* Output: UM_HALTED, UM_BLOCKED or UM_PREEMPTED.
+* Side Effects: side effects of the executed instructions.
+* Error Conditions: CRE if um is null. all error conditions of called opcode
+*                   instructions apply.
+*/
+Um_status um_run(Um_T um, uint64_t budget)
+{
+    assert(um != NULL);
+    if (um -> halted) {
+        return UM_HALTED;
+    }
+
+    Seq_T segments = um -> segments;
+    uint32_t *registers = um -> registers;
+    uint64_t done = 0;
+
+    while (um -> counter < Seq_length(Seq_get(segments, 0))) {
+        if (budget != 0 && done >= budget) {
+            return UM_PREEMPTED;
         }
 
-        execute(instructions, segments, ids, registers, &counter);
+        if (um -> mode == ACCEL_ON) {
+            int start = um -> counter;
+            uint64_t steps = accel_run(um -> accel, segments, registers,
+                                       &um -> counter, um -> out);
+            if (steps > 0) {
+                if (um -> perf != NULL) {
+                    perfctr_native(um -> perf, start, steps);
+                }
+                if (um -> metrics != NULL) {
+                    metrics_step(um -> metrics, start, steps);
+                }
+                done += steps;
+                continue;
+            }
+        }
+        if (um -> mode == ACCEL_VERIFY) {
+            uint64_t steps = verify(segments, um -> ids, registers,
+                                    &um -> counter, um -> accel, um -> perf,
+                                    um -> metrics, &um -> input, um -> out);
+            if (steps > 0) {
+                done += steps;
+                continue;
+            }
+        }
 
-        if (instructions -> opcode != LOADP) {
-            counter++;
+        Um_status status = step(segments, um -> ids, registers,
+                                &um -> counter, um -> accel, um -> perf,
+                                um -> metrics, &um -> input, um -> out);
+        if (status == UM_HALTED) {
+            break;
+        } else if (status == UM_BLOCKED) {
+            return UM_BLOCKED;
         }
+        done++;
+    }
 
-        FREE(instructions);
+    return halt(um);
+}
+
+/*
+* Name: um_free
+* Summary: frees the guest, its routine table and all of its segments.
+* Input: um is a pointer to a valid non-null Um_T.
+* Output: N/A
+* Side Effects: *um is freed and set to NULL.
+* Error Conditions: CRE if um or *um is null.
+*/
+void um_free(Um_T *um)
+{
+    assert(um != NULL && *um != NULL);
+    if ((*um) -> accel != NULL) {
+        accel_free(&(*um) -> accel);
     }
+    free_sequences((*um) -> segments, (*um) -> ids);
+    FREE(*um);
+}
+
+static int stdin_ready(void *cl)
+{
+    (void) cl;
+    return 1;
+}
+
+static int stdin_get(void *cl)
+{
+    (void) cl;
+    return getc(stdin);
+}
 
-    free(registers);
-    free_sequences(segments, ids);
-}
\ No newline at end of file
+/*
+* Name: um
+* Summary: um is the function called by um.c in main. um runs the read in
+*          segment 0 as one guest reading standard input, which it waits
+*          on, and writing standard output, until it halts.
+* Input: segment 0 (sequence). expected to be a valid non-null Seq_T. mode
+*        picks whether recognised guest routines run natively (see accel.h).
+*        perf is the hardware counters to sample around the loop, or NULL.
+*        metrics is the shared block live counts are published in, or NULL.
+* Output: N/A
+* Side Effects: as for um_new() and um_run(). All memory is freed again.
+*
+* Error Conditions: CRE if seg0 is null. all error conditions of called opcode
+*                   instructions apply.
+*/
+void um(Seq_T seg0, Accel_mode mode, Perfctr_T perf, Metrics_T metrics)
+{
+    Um_input input = { stdin_ready, stdin_get, NULL };
+    Um_T guest = um_new(seg0, mode, perf, metrics, input, stdout);
+    um_run(guest, 0);
+    um_free(&guest);
+}
@@ -18,19 +18,74 @@
 #include "um_reader.h"
 #include "bitpack.h"
 #include "unpack.h"
+#include "accel.h"
+#include "perfctr.h"
+#include "metrics.h"
 
 typedef enum Um_opcode {
     CMOV = 0, SLOAD, SSTORE, ADD, MUL, DIV,
     NAND, HALT, ACTIVATE, INACTIVATE, OUT, IN, LOADP, LV
 } Um_opcode;
 
+/*
+* HALTED: the guest halted or ran off the end of segment 0. BLOCKED: the
+* guest is at an IN and no byte is ready; it resumes at that IN. PREEMPTED:
+* the guest used up its budget of instructions.
+*/
+typedef enum Um_status {
+    UM_RUNNING = 0, UM_HALTED, UM_BLOCKED, UM_PREEMPTED
+} Um_status;
+
+/*
+* Where IN takes its bytes from. ready returns 1 if get would not have to
+* wait for a byte, get returns the next byte or EOF. cl is passed to both.
+*/
+typedef struct Um_input {
+    int (*ready)(void *cl);
+    int (*get)(void *cl);
+    void *cl;
+} Um_input;
+
+typedef struct Um_T *Um_T;
+
+/*
+* Name: um_new
+* Usage: creates a guest that runs the program in seg0 with its own
+*        segments and registers, reading IN from input and writing OUT to
+*        out. The guest owns seg0 from then on.
+* Expected Input: seg0 and out are valid non null, mode, perf and metrics
+*                 are as for um().
+*/
+extern Um_T um_new(Seq_T seg0, Accel_mode mode, Perfctr_T perf,
+                   Metrics_T metrics, Um_input input, FILE *out);
+
+/*
+* Name: um_run
+* Usage: runs the guest until it halts, blocks on input or has run budget
+*        instructions (0 for no limit).
+* Output: UM_HALTED, UM_BLOCKED or UM_PREEMPTED. Running a halted guest
+*         again returns UM_HALTED.
+*/
+extern Um_status um_run(Um_T um, uint64_t budget);
+
+/*
+* Name: um_free
+* Usage: frees the guest and all of its segments.
+*/
+extern void um_free(Um_T *um);
+
 /*
 * Name: um
 * Usage: um is called by main. um creates the sequence of segments and executes
-*        the instructions from the supplied segment 0.
+*        the instructions from the supplied segment 0, with IN reading
+*        standard input and OUT writing standard output.
 * Expected Input: seg0 is expected to be a valid non null sequence of 
-*                 valid instruction code words.
+*                 valid instruction code words. mode is ACCEL_OFF to
+*                 interpret every instruction, ACCEL_ON to run recognised
+*                 routines natively or ACCEL_VERIFY to run both and compare.
+*                 perf is the counters to sample, or NULL. metrics is the
+*                 shared block to publish live counts in, or NULL.
 */
-void um(Seq_T seg0);
+void um(Seq_T seg0, Accel_mode mode, Perfctr_T perf, Metrics_T metrics);
 
 #endif
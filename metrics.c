@@ -0,0 +1,265 @@
+/*
+*                       metrics.c
+*
+*
+*   Summary: metrics.c is the implementation for metrics.h. The guest side
+*            keeps its counts in a private struct and copies them into the
+*            shared block every N instructions between two increments of
+*            seq. The reader side maps the block read only and copies it
+*            until it sees the same even seq before and after.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mem.h>
+
+#include "metrics.h"
+
+struct Metrics_T {
+    struct Metrics_block *block;
+    struct Metrics_block local;
+    uint64_t every;
+    uint64_t countdown;
+    char name[32];
+};
+
+static void block_name(char *name, size_t size, pid_t pid)
+{
+    snprintf(name, size, "/um.%ld", (long) pid);
+}
+
+/*
+* Name: store
+* Summary: stores one field of the shared block. Relaxed atomics keep the
+*          stores whole; ordering comes from the fences around them.
+*/
+static void store(uint64_t *field, uint64_t value)
+{
+    __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *field)
+{
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+/*
+* Name: publish
+* Summary: copies the private counts into the shared block. seq is odd
+*          for the duration of the copy.
+*/
+static void publish(Metrics_T metrics)
+{
+    struct Metrics_block *block = metrics -> block;
+    struct Metrics_block *local = &metrics -> local;
+    uint32_t seq = block -> seq;
+
+    __atomic_store_n(&block -> seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    store(&block -> state, local -> state);
+    store(&block -> instructions, local -> instructions);
+    store(&block -> pc, local -> pc);
+    store(&block -> segments, local -> segments);
+    store(&block -> mapped_bytes, local -> mapped_bytes);
+    store(&block -> maps, local -> maps);
+    store(&block -> unmaps, local -> unmaps);
+    store(&block -> loads, local -> loads);
+
+    __atomic_store_n(&block -> seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+* Name: metrics_new
+* Summary: creates and maps the shared block /um.<pid> and publishes a
+*          block with no instructions run.
+* Input: every is non zero.
+* Output: returns the new Metrics_T.
+* Side Effects: creates a shared memory object.
+* Error Conditions: CRE if every is 0 or not enough memory, exits with
+*                   EXIT_FAILURE if the shared block cannot be created.
+*/
+Metrics_T metrics_new(uint64_t every)
+{
+    assert(every != 0);
+    Metrics_T metrics;
+    NEW0(metrics);
+    assert(metrics != NULL);
+
+    metrics -> every = every;
+    metrics -> countdown = every;
+    block_name(metrics -> name, sizeof(metrics -> name), getpid());
+
+    int fd = shm_open(metrics -> name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(struct Metrics_block)) != 0) {
+        fprintf(stderr, "Could not create %s\n", metrics -> name);
+        exit(EXIT_FAILURE);
+    }
+    metrics -> block = mmap(NULL, sizeof(struct Metrics_block),
+                            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (metrics -> block == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", metrics -> name);
+        exit(EXIT_FAILURE);
+    }
+
+    metrics -> local.pid = getpid();
+    metrics -> block -> pid = getpid();
+    publish(metrics);
+    __atomic_store_n(&metrics -> block -> magic, METRICS_MAGIC,
+                     __ATOMIC_RELEASE);
+    return metrics;
+}
+
+/*
+* Name: metrics_free
+* Summary: unmaps and removes the shared block and frees metrics. A reader
+*          that already has the block mapped keeps its last contents.
+* Input: metrics is a pointer to a valid non null Metrics_T.
+* Output: N/A
+* Side Effects: *metrics is freed and set to NULL.
+* Error Conditions: CRE if metrics or *metrics is NULL.
+*/
+void metrics_free(Metrics_T *metrics)
+{
+    assert(metrics != NULL && *metrics != NULL);
+    munmap((*metrics) -> block, sizeof(struct Metrics_block));
+    shm_unlink((*metrics) -> name);
+    FREE(*metrics);
+}
+
+void metrics_step(Metrics_T metrics, int counter, uint64_t n)
+{
+    metrics -> local.instructions += n;
+    metrics -> local.pc = counter;
+    if (metrics -> countdown <= n) {
+        metrics -> countdown = metrics -> every;
+        publish(metrics);
+    } else {
+        metrics -> countdown -= n;
+    }
+}
+
+void metrics_map(Metrics_T metrics, uint64_t words)
+{
+    assert(metrics != NULL);
+    metrics -> local.segments++;
+    metrics -> local.maps++;
+    metrics -> local.mapped_bytes += words * sizeof(uint32_t);
+}
+
+void metrics_unmap(Metrics_T metrics, uint64_t words)
+{
+    assert(metrics != NULL);
+    metrics -> local.segments--;
+    metrics -> local.unmaps++;
+    metrics -> local.mapped_bytes -= words * sizeof(uint32_t);
+}
+
+void metrics_load(Metrics_T metrics, int64_t words)
+{
+    assert(metrics != NULL);
+    metrics -> local.loads++;
+    metrics -> local.mapped_bytes += words * (int64_t) sizeof(uint32_t);
+}
+
+void metrics_state(Metrics_T metrics, Metrics_state state)
+{
+    assert(metrics != NULL);
+    metrics -> local.state = state;
+    publish(metrics);
+}
+
+/*
+* Name: metrics_attach
+* Summary: maps the shared block of guest pid read only.
+* Input: pid is the process id of a guest run with --stats.
+* Output: returns the block, or NULL if there is none or it is not ready.
+* Side Effects: maps the block.
+* Error Conditions: N/A
+*/
+const struct Metrics_block *metrics_attach(pid_t pid)
+{
+    char name[32];
+    block_name(name, sizeof(name), pid);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat buf;
+    if (fstat(fd, &buf) != 0
+        || buf.st_size < (off_t) sizeof(struct Metrics_block)) {
+        close(fd);
+        return NULL;
+    }
+
+    const struct Metrics_block *block = mmap(NULL,
+                                             sizeof(struct Metrics_block),
+                                             PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&block -> magic, __ATOMIC_ACQUIRE)
+        != METRICS_MAGIC) {
+        metrics_detach(block);
+        return NULL;
+    }
+    return block;
+}
+
+void metrics_detach(const struct Metrics_block *block)
+{
+    assert(block != NULL);
+    munmap((void *) block, sizeof(struct Metrics_block));
+}
+
+/*
+* Name: metrics_read
+* Summary: copies block into snapshot, retrying while the guest is in the
+*          middle of publishing.
+* Input: block came from metrics_attach, snapshot is valid non null.
+* Output: N/A
+* Side Effects: snapshot is filled in.
+* Error Conditions: CRE if block or snapshot is NULL.
+*/
+void metrics_read(const struct Metrics_block *block,
+                  struct Metrics_block *snapshot)
+{
+    assert(block != NULL && snapshot != NULL);
+    uint32_t before, after;
+
+    do {
+        before = __atomic_load_n(&block -> seq, __ATOMIC_ACQUIRE);
+
+        snapshot -> magic = block -> magic;
+        snapshot -> pid = load(&block -> pid);
+        snapshot -> state = load(&block -> state);
+        snapshot -> instructions = load(&block -> instructions);
+        snapshot -> pc = load(&block -> pc);
+        snapshot -> segments = load(&block -> segments);
+        snapshot -> mapped_bytes = load(&block -> mapped_bytes);
+        snapshot -> maps = load(&block -> maps);
+        snapshot -> unmaps = load(&block -> unmaps);
+        snapshot -> loads = load(&block -> loads);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&block -> seq, __ATOMIC_RELAXED);
+    } while ((before & 1) != 0 || before != after);
+
+    snapshot -> seq = before;
+}
+
+void metrics_unlink(pid_t pid)
+{
+    char name[32];
+    block_name(name, sizeof(name), pid);
+    shm_unlink(name);
+}
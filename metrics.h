@@ -0,0 +1,123 @@
+/*
+*                       metrics.h
+*
+*
+*   Summary: Interface for metrics. metrics publishes the live state of a
+*            running guest (instructions executed, program counter, mapped
+*            segments and bytes) in a POSIX shared memory block named
+*            /um.<pid>, so umstat can watch it without stopping the guest.
+*            The block is updated seqlock style every N instructions with
+*            plain memory writes, no system calls.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#ifndef METRICS_READER
+#define METRICS_READER
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define METRICS_MAGIC 0x554d5354
+
+typedef enum Metrics_state {
+    METRICS_RUNNING = 0, METRICS_WAITING_INPUT, METRICS_HALTED
+} Metrics_state;
+
+/*
+* The shared block. seq is odd while the guest is writing; a reader copies
+* the block and retries if seq was odd or changed under it.
+*/
+struct Metrics_block {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t pid;
+    uint64_t state;
+    uint64_t instructions;
+    uint64_t pc;
+    uint64_t segments;
+    uint64_t mapped_bytes;
+    uint64_t maps;
+    uint64_t unmaps;
+    uint64_t loads;
+};
+
+typedef struct Metrics_T *Metrics_T;
+
+/*
+* Name: metrics_new
+* Usage: called by main when --stats is given. Creates /um.<pid> and
+*        publishes an initial block.
+* Expected Input: every is the number of guest instructions between
+*                 updates and is non zero.
+*/
+extern Metrics_T metrics_new(uint64_t every);
+
+/*
+* Name: metrics_free
+* Usage: unmaps and removes the shared block and frees metrics.
+*/
+extern void metrics_free(Metrics_T *metrics);
+
+/*
+* Name: metrics_step
+* Usage: counts n guest instructions ending at counter and publishes the
+*        block once `every` of them have been counted.
+*/
+extern void metrics_step(Metrics_T metrics, int counter, uint64_t n);
+
+/*
+* Name: metrics_map
+* Usage: counts a segment of words words being mapped.
+*/
+extern void metrics_map(Metrics_T metrics, uint64_t words);
+
+/*
+* Name: metrics_unmap
+* Usage: counts a segment of words words being unmapped.
+*/
+extern void metrics_unmap(Metrics_T metrics, uint64_t words);
+
+/*
+* Name: metrics_load
+* Usage: counts a LOADP that replaced segment 0, which grew by words.
+*/
+extern void metrics_load(Metrics_T metrics, int64_t words);
+
+/*
+* Name: metrics_state
+* Usage: publishes the block at once with the guest in state, e.g. before
+*        it blocks on input and when it halts.
+*/
+extern void metrics_state(Metrics_T metrics, Metrics_state state);
+
+/*
+* Name: metrics_attach
+* Usage: called by umstat. Maps the block of guest pid read only.
+* Output: the block, or NULL if pid has none.
+*/
+extern const struct Metrics_block *metrics_attach(pid_t pid);
+
+/*
+* Name: metrics_detach
+* Usage: unmaps a block from metrics_attach.
+*/
+extern void metrics_detach(const struct Metrics_block *block);
+
+/*
+* Name: metrics_read
+* Usage: takes a consistent copy of block into snapshot.
+*/
+extern void metrics_read(const struct Metrics_block *block,
+                         struct Metrics_block *snapshot);
+
+/*
+* Name: metrics_unlink
+* Usage: removes the block of guest pid, for guests that died without
+*        removing it.
+*/
+extern void metrics_unlink(pid_t pid);
+
+#endif
@@ -0,0 +1,489 @@
+/*
+*                       perfctr.c
+*
+*
+*   Summary: perfctr.c is the implementation for perfctr.h. perfctr.c opens
+*            the events as one perf_event_open group, so the kernel counts
+*            them over the same time slices and the IPC holds up when it
+*            multiplexes. It counts guest instructions by program counter
+*            range and opcode, and writes a JSON line per sample, range
+*            records per guest phase, and per opcode and total records at
+*            the end of the run.
+*
+*            Counter deltas are attributed to the program counter ranges of
+*            an interval in proportion to the guest instructions each range
+*            ran, so a short interval gives a sharper picture. A LOADP of
+*            segment 0 ends the interval and the phase, since the same
+*            ranges then hold different code.
+*
+*            The range and opcode counts are kept for every guest
+*            instruction whatever the sample rate, and that work is inside
+*            the counters. Compare engines with the same --perf settings.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#include <assert.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <mem.h>
+
+#include "perfctr.h"
+
+#define NUM_EVENTS 5
+#define NUM_OPCODES 16
+#define RANGE_SHIFT 6
+
+enum Event_id {
+    TASK_CLOCK = 0, CYCLES, INSTRUCTIONS, BRANCH_MISSES, CACHE_MISSES
+};
+
+static const struct Event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[NUM_EVENTS] = {
+    { "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK      },
+    { "cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES      },
+    { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS    },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES   },
+    { "cache_misses",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES    }
+};
+
+/* Indexed by Um_opcode; 14 and 15 are not valid instructions. */
+static const char *opcode_names[NUM_OPCODES] = {
+    "CMOV", "SLOAD", "SSTORE", "ADD", "MUL", "DIV", "NAND", "HALT",
+    "ACTIVATE", "INACTIVATE", "OUT", "IN", "LOADP", "LV", "OP14", "OP15"
+};
+
+struct Range {
+    uint64_t guest;
+    double counts[NUM_EVENTS];
+};
+
+struct Perfctr_T {
+    FILE *report;
+    uint64_t every;
+    const char *engine;
+    int fds[NUM_EVENTS];
+    int slots[NUM_EVENTS];
+    int leader;
+    int num_open;
+    uint64_t last[NUM_EVENTS];
+    uint64_t samples;
+    uint64_t phase;
+
+    /* counts for the current interval */
+    uint64_t countdown;
+    uint64_t guest, native, loads;
+    uint64_t opcodes[NUM_OPCODES];
+    uint64_t *interval;
+    int *touched;
+    int num_touched;
+
+    /* counts for the whole run */
+    struct Range *ranges;
+    int num_ranges;
+    uint64_t total_guest, total_native, total_loads;
+    uint64_t total_opcodes[NUM_OPCODES];
+    uint64_t total[NUM_EVENTS];
+};
+
+/*
+* Name: open_event
+* Summary: opens a counter for event on this process, user space only so
+*          it works at the default perf_event_paranoid level. With leader
+*          -1 it starts a new, disabled group; otherwise it joins leader's
+*          group and is enabled and read along with it.
+* Output: returns the file descriptor, or -1 if the kernel refuses it.
+*/
+static int open_event(const struct Event *event, int leader)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event -> type;
+    attr.config = event -> config;
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                       | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/*
+* Name: read_group
+* Summary: reads every counter in the group at once, scaled up for any
+*          time the kernel multiplexed the group off the hardware. The
+*          values come in the order the counters were opened.
+* Output: returns 1 and sets values[e] for each open event on success,
+*         0 otherwise.
+*/
+static int read_group(Perfctr_T perf, uint64_t *values)
+{
+    uint64_t buf[3 + NUM_EVENTS];
+    ssize_t size = (3 + perf -> num_open) * (ssize_t) sizeof(uint64_t);
+    if (perf -> leader < 0 || read(perf -> leader, buf, size) != size
+        || buf[0] != (uint64_t) perf -> num_open) {
+        return 0;
+    }
+
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        if (perf -> fds[e] < 0) {
+            continue;
+        }
+        uint64_t value = buf[3 + perf -> slots[e]];
+        if (buf[2] == 0) {
+            values[e] = 0;
+        } else if (buf[1] == buf[2]) {
+            values[e] = value;
+        } else {
+            values[e] = (uint64_t) ((double) value * buf[1] / buf[2]);
+        }
+    }
+    return 1;
+}
+
+/*
+* Name: range_at
+* Summary: returns the range counter falls in, growing the range tables
+*          when the guest runs past the end of them.
+*/
+static int range_at(Perfctr_T perf, int counter)
+{
+    int range = counter >> RANGE_SHIFT;
+    if (range < perf -> num_ranges) {
+        return range;
+    }
+
+    int old = perf -> num_ranges;
+    int length = 2 * (range + 1);
+    RESIZE(perf -> ranges, length * (long) sizeof(struct Range));
+    RESIZE(perf -> interval, length * (long) sizeof(uint64_t));
+    RESIZE(perf -> touched, length * (long) sizeof(int));
+    assert(perf -> ranges != NULL && perf -> interval != NULL
+           && perf -> touched != NULL);
+
+    memset(&perf -> ranges[old], 0, (length - old) * sizeof(struct Range));
+    memset(&perf -> interval[old], 0, (length - old) * sizeof(uint64_t));
+    perf -> num_ranges = length;
+    return range;
+}
+
+static void print_count(FILE *report, const char *name, int have,
+                        uint64_t value)
+{
+    if (have) {
+        fprintf(report, ",\"%s\":%" PRIu64, name, value);
+    } else {
+        fprintf(report, ",\"%s\":null", name);
+    }
+}
+
+static void print_ipc(FILE *report, int have, uint64_t cycles,
+                      uint64_t instructions)
+{
+    if (have && cycles != 0) {
+        fprintf(report, ",\"ipc\":%.3f", (double) instructions / cycles);
+    } else {
+        fprintf(report, ",\"ipc\":null");
+    }
+}
+
+/*
+* Name: sample
+* Summary: reads every open counter and writes a sample record for the
+*          current interval: guest and native instruction counts, LOADPs
+*          of segment 0, counter deltas, opcode mix and the instructions run
+*          in each program counter range. The deltas are then attributed to
+*          those ranges and the interval is cleared.
+*/
+static void sample(Perfctr_T perf)
+{
+    uint64_t now[NUM_EVENTS];
+    uint64_t delta[NUM_EVENTS];
+    int have[NUM_EVENTS];
+    FILE *report = perf -> report;
+    int read_ok = read_group(perf, now);
+
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        have[e] = read_ok && perf -> fds[e] >= 0;
+        delta[e] = have[e] ? now[e] - perf -> last[e] : 0;
+        if (have[e]) {
+            perf -> last[e] = now[e];
+            perf -> total[e] += delta[e];
+        }
+    }
+
+    fprintf(report, "{\"type\":\"sample\",\"index\":%" PRIu64
+                    ",\"phase\":%" PRIu64
+                    ",\"guest_instructions\":%" PRIu64
+                    ",\"native_instructions\":%" PRIu64
+                    ",\"loads\":%" PRIu64,
+            perf -> samples, perf -> phase, perf -> guest, perf -> native,
+            perf -> loads);
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        print_count(report, events[e].name, have[e], delta[e]);
+    }
+    print_ipc(report, have[CYCLES] && have[INSTRUCTIONS], delta[CYCLES],
+              delta[INSTRUCTIONS]);
+
+    fprintf(report, ",\"opcodes\":{");
+    const char *sep = "";
+    for (int i = 0; i < NUM_OPCODES; i++) {
+        if (perf -> opcodes[i] != 0) {
+            fprintf(report, "%s\"%s\":%" PRIu64, sep, opcode_names[i],
+                    perf -> opcodes[i]);
+            sep = ",";
+        }
+        perf -> total_opcodes[i] += perf -> opcodes[i];
+        perf -> opcodes[i] = 0;
+    }
+
+    fprintf(report, "},\"ranges\":[");
+    for (int i = 0; i < perf -> num_touched; i++) {
+        int range = perf -> touched[i];
+        uint64_t guest = perf -> interval[range];
+        double share = (double) guest / perf -> guest;
+
+        fprintf(report, "%s[%d,%" PRIu64 "]", i == 0 ? "" : ",",
+                range << RANGE_SHIFT, guest);
+        perf -> ranges[range].guest += guest;
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            perf -> ranges[range].counts[e] += share * delta[e];
+        }
+        perf -> interval[range] = 0;
+    }
+    fprintf(report, "]}\n");
+
+    perf -> total_guest += perf -> guest;
+    perf -> total_native += perf -> native;
+    perf -> total_loads += perf -> loads;
+    perf -> guest = perf -> native = perf -> loads = 0;
+    perf -> num_touched = 0;
+    perf -> countdown = perf -> every;
+    perf -> samples++;
+}
+
+/*
+* Name: write_ranges
+* Summary: writes a record per program counter range that ran in the
+*          current phase, then clears the ranges for the next phase.
+*/
+static void write_ranges(Perfctr_T perf)
+{
+    FILE *report = perf -> report;
+    for (int i = 0; i < perf -> num_ranges; i++) {
+        struct Range *range = &perf -> ranges[i];
+        if (range -> guest == 0) {
+            continue;
+        }
+        fprintf(report, "{\"type\":\"range\",\"phase\":%" PRIu64
+                        ",\"first_pc\":%d,\"last_pc\":%d"
+                        ",\"guest_instructions\":%" PRIu64,
+                perf -> phase, i << RANGE_SHIFT, ((i + 1) << RANGE_SHIFT) - 1,
+                range -> guest);
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            print_count(report, events[e].name, perf -> fds[e] >= 0,
+                        (uint64_t) range -> counts[e]);
+        }
+        print_ipc(report, perf -> fds[CYCLES] >= 0
+                          && perf -> fds[INSTRUCTIONS] >= 0,
+                  (uint64_t) range -> counts[CYCLES],
+                  (uint64_t) range -> counts[INSTRUCTIONS]);
+        fprintf(report, "}\n");
+    }
+    memset(perf -> ranges, 0, perf -> num_ranges * sizeof(struct Range));
+}
+
+/*
+* Name: attribute
+* Summary: counts n guest instructions run at counter and takes a sample
+*          once `every` of them have been counted.
+*/
+static void attribute(Perfctr_T perf, int counter, uint64_t n)
+{
+    int range = range_at(perf, counter);
+    if (perf -> interval[range] == 0) {
+        perf -> touched[perf -> num_touched++] = range;
+    }
+    perf -> interval[range] += n;
+    perf -> guest += n;
+
+    if (perf -> countdown <= n) {
+        sample(perf);
+    } else {
+        perf -> countdown -= n;
+    }
+}
+
+/*
+* Name: perfctr_new
+* Summary: opens every event it can as one group, led by the first that
+*          opens, and writes a config record naming the engine, sample
+*          rate, range size and which events are available.
+* Input: report is open for writing, every is non zero, engine is non null.
+* Output: returns the new Perfctr_T.
+* Side Effects: opens up to NUM_EVENTS file descriptors.
+* Error Conditions: CRE if report or engine is NULL or every is 0, CRE if
+*                   not enough memory.
+*/
+Perfctr_T perfctr_new(FILE *report, uint64_t every, const char *engine)
+{
+    assert(report != NULL && every != 0 && engine != NULL);
+    Perfctr_T perf;
+    NEW0(perf);
+    assert(perf != NULL);
+
+    perf -> report = report;
+    perf -> every = every;
+    perf -> engine = engine;
+    perf -> countdown = every;
+    perf -> leader = -1;
+    perf -> num_ranges = 1;
+    perf -> ranges = CALLOC(1, sizeof(struct Range));
+    perf -> interval = CALLOC(1, sizeof(uint64_t));
+    perf -> touched = CALLOC(1, sizeof(int));
+    assert(perf -> ranges != NULL && perf -> interval != NULL
+           && perf -> touched != NULL);
+
+    fprintf(report, "{\"type\":\"config\",\"engine\":\"%s\",\"every\":%"
+                    PRIu64 ",\"range_words\":%d,\"events\":{",
+            engine, every, 1 << RANGE_SHIFT);
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        perf -> fds[e] = open_event(&events[e], perf -> leader);
+        if (perf -> fds[e] >= 0) {
+            perf -> slots[e] = perf -> num_open++;
+            if (perf -> leader < 0) {
+                perf -> leader = perf -> fds[e];
+            }
+        }
+        fprintf(report, "%s\"%s\":%s", e == 0 ? "" : ",", events[e].name,
+                perf -> fds[e] >= 0 ? "true" : "false");
+    }
+    fprintf(report, "}}\n");
+
+    if (perf -> fds[CYCLES] < 0) {
+        fprintf(stderr, "perf_event_open: hardware counters unavailable, "
+                        "reporting null\n");
+    }
+    return perf;
+}
+
+/*
+* Name: perfctr_free
+* Summary: closes every counter and frees perf.
+* Input: perf is a pointer to a valid non null Perfctr_T.
+* Output: N/A
+* Side Effects: *perf is freed and set to NULL. The report stays open.
+* Error Conditions: CRE if perf or *perf is NULL.
+*/
+void perfctr_free(Perfctr_T *perf)
+{
+    assert(perf != NULL && *perf != NULL);
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        if ((*perf) -> fds[e] >= 0) {
+            close((*perf) -> fds[e]);
+        }
+    }
+    FREE((*perf) -> ranges);
+    FREE((*perf) -> interval);
+    FREE((*perf) -> touched);
+    FREE(*perf);
+}
+
+/*
+* Name: perfctr_start
+* Summary: resets and enables the counter group.
+* Input: perf is valid non null.
+* Output: N/A
+* Side Effects: the counters start counting.
+* Error Conditions: CRE if perf is NULL.
+*/
+void perfctr_start(Perfctr_T perf)
+{
+    assert(perf != NULL);
+    if (perf -> leader >= 0) {
+        ioctl(perf -> leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf -> leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    memset(perf -> last, 0, sizeof(perf -> last));
+}
+
+/*
+* Name: perfctr_stop
+* Summary: disables the counters, samples the last partial interval and
+*          writes the range records of the last phase and a record per
+*          opcode and for the whole run.
+* Input: perf is valid non null.
+* Output: N/A
+* Side Effects: writes to the report and flushes it.
+* Error Conditions: CRE if perf is NULL.
+*/
+void perfctr_stop(Perfctr_T perf)
+{
+    assert(perf != NULL);
+    if (perf -> guest != 0) {
+        sample(perf);
+    }
+    if (perf -> leader >= 0) {
+        ioctl(perf -> leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    FILE *report = perf -> report;
+    write_ranges(perf);
+
+    for (int i = 0; i < NUM_OPCODES; i++) {
+        if (perf -> total_opcodes[i] != 0) {
+            fprintf(report, "{\"type\":\"opcode\",\"name\":\"%s\""
+                            ",\"count\":%" PRIu64 "}\n",
+                    opcode_names[i], perf -> total_opcodes[i]);
+        }
+    }
+
+    fprintf(report, "{\"type\":\"total\",\"engine\":\"%s\",\"samples\":%"
+                    PRIu64 ",\"phases\":%" PRIu64
+                    ",\"guest_instructions\":%" PRIu64
+                    ",\"native_instructions\":%" PRIu64
+                    ",\"loads\":%" PRIu64,
+            perf -> engine, perf -> samples, perf -> phase + 1,
+            perf -> total_guest,
+            perf -> total_native, perf -> total_loads);
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        print_count(report, events[e].name, perf -> fds[e] >= 0,
+                    perf -> total[e]);
+    }
+    print_ipc(report, perf -> fds[CYCLES] >= 0
+                      && perf -> fds[INSTRUCTIONS] >= 0,
+              perf -> total[CYCLES], perf -> total[INSTRUCTIONS]);
+    fprintf(report, "}\n");
+    fflush(report);
+}
+
+void perfctr_load(Perfctr_T perf)
+{
+    assert(perf != NULL);
+    perf -> loads++;
+    sample(perf);
+    write_ranges(perf);
+    perf -> phase++;
+}
+
+void perfctr_native(Perfctr_T perf, int counter, uint64_t steps)
+{
+    assert(perf != NULL);
+    perf -> native += steps;
+    attribute(perf, counter, steps);
+}
+
+void perfctr_count(Perfctr_T perf, int counter, uint32_t opcode)
+{
+    perf -> opcodes[opcode & (NUM_OPCODES - 1)]++;
+    attribute(perf, counter, 1);
+}
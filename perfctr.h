@@ -0,0 +1,79 @@
+/*
+*                       perfctr.h
+*
+*
+*   Summary: Interface for perfctr. perfctr opens Linux perf_event_open
+*            counters (task clock, cycles, instructions, branch misses and
+*            cache misses) around the um() run loop, reads them every N
+*            guest instructions and attributes each interval to the guest
+*            program counter ranges of the current phase (the program
+*            between two LOADPs of segment 0) and opcode mix that ran in it. Samples
+*            and totals are written to a report file as JSON lines.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#ifndef PERFCTR_READER
+#define PERFCTR_READER
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+typedef struct Perfctr_T *Perfctr_T;
+
+/*
+* Name: perfctr_new
+* Usage: called by main when --perf is given. Opens whichever counters the
+*        kernel allows; ones it refuses are reported as null.
+* Expected Input: report is a stream open for writing, every is the number
+*                 of guest instructions between samples and is non zero,
+*                 engine names the execution strategy for the report.
+*/
+extern Perfctr_T perfctr_new(FILE *report, uint64_t every,
+                             const char *engine);
+
+/*
+* Name: perfctr_free
+* Usage: closes the counters and frees perf. Does not close the report.
+*/
+extern void perfctr_free(Perfctr_T *perf);
+
+/*
+* Name: perfctr_start
+* Usage: called by um() just before the run loop. Resets and enables the
+*        counters.
+*/
+extern void perfctr_start(Perfctr_T perf);
+
+/*
+* Name: perfctr_stop
+* Usage: called by um() after the run loop. Takes the last sample and
+*        writes the last phase's range records and the per opcode and
+*        total records.
+*/
+extern void perfctr_stop(Perfctr_T perf);
+
+/*
+* Name: perfctr_load
+* Usage: called when LOADP replaces segment 0. Takes a sample, writes the
+*        range records of the phase that ended and starts a new phase, so
+*        ranges never mix counts from two programs.
+*/
+extern void perfctr_load(Perfctr_T perf);
+
+/*
+* Name: perfctr_native
+* Usage: counts steps guest instructions that a native routine starting at
+*        counter ran in place of the interpreter.
+*/
+extern void perfctr_native(Perfctr_T perf, int counter, uint64_t steps);
+
+/*
+* Name: perfctr_count
+* Usage: counts one interpreted guest instruction with opcode at counter.
+*        Called once per guest instruction while --perf is on.
+*/
+extern void perfctr_count(Perfctr_T perf, int counter, uint32_t opcode);
+
+#endif
@@ -0,0 +1,688 @@
+/*
+*                       serve.c
+*
+*
+*   Summary: serve.c is the implementation for serve.h. Each client gets a
+*            Guest holding its Um_T, an input buffer IN reads from and an
+*            output buffer OUT appends to. The loop runs every runnable
+*            guest for a quantum in turn and between rounds waits on epoll,
+*            without blocking while any guest can run. A guest's output is
+*            sent after each of its turns, when it blocks on input and when
+*            it halts, so a flood of OUT becomes a few large writes. A guest
+*            with more than OUT_LIMIT bytes unsent is not run again until
+*            the client catches up.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <mem.h>
+#include <except.h>
+
+#include "serve.h"
+#include "execute.h"
+
+#define IN_SIZE 4096
+#define OUT_LIMIT (256 * 1024)
+#define MAX_EVENTS 256
+#define PAUSE_MS 100
+
+/*
+* RUNNABLE guests are run every round, INPUT guests wait for a byte,
+* OUTPUT guests wait for the client to read, CLOSING guests have halted
+* and wait for the rest of their output to be sent.
+*/
+typedef enum Guest_state {
+    GUEST_RUNNABLE, GUEST_INPUT, GUEST_OUTPUT, GUEST_CLOSING
+} Guest_state;
+
+struct Guest {
+    int fd;
+    uint32_t events;
+    Guest_state state;
+    Um_T um;
+    FILE *out;
+
+    unsigned char in[IN_SIZE];
+    size_t in_head;
+    size_t in_tail;
+    int in_eof;
+
+    char *pending;
+    size_t pending_len;
+    size_t pending_sent;
+    size_t pending_size;
+
+    struct Guest *prev;
+    struct Guest *next;
+};
+
+struct Server {
+    int epoll_fd;
+    int listen_fd;
+    int spare_fd;
+    int paused;
+    int tcp;
+    const char *unix_path;
+    Seq_T program;
+    Accel_mode mode;
+    int max_guests;
+    int num_guests;
+    struct Guest *guests;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal)
+{
+    (void) signal;
+    stopping = 1;
+}
+
+/*
+* Name: guest_ready
+* Summary: IN's ready function for a guest: a byte is buffered or the
+*          client has shut down its side.
+*/
+static int guest_ready(void *cl)
+{
+    struct Guest *guest = cl;
+    return guest -> in_head < guest -> in_tail || guest -> in_eof;
+}
+
+/*
+* Name: guest_get
+* Summary: IN's get function for a guest. The buffer starts over once it
+*          has been read to the end, so there is room to receive again.
+*/
+static int guest_get(void *cl)
+{
+    struct Guest *guest = cl;
+    if (guest -> in_head == guest -> in_tail) {
+        return EOF;
+    }
+    int c = guest -> in[guest -> in_head++];
+    if (guest -> in_head == guest -> in_tail) {
+        guest -> in_head = 0;
+        guest -> in_tail = 0;
+    }
+    return c;
+}
+
+/*
+* Name: guest_write
+* Summary: write function of the guest's output stream. Appends to the
+*          guest's unsent output; nothing is sent until flush().
+*/
+static ssize_t guest_write(void *cl, const char *buf, size_t size)
+{
+    struct Guest *guest = cl;
+    if (guest -> pending_len + size > guest -> pending_size) {
+        size_t new_size = 2 * (guest -> pending_len + size);
+        RESIZE(guest -> pending, new_size);
+        guest -> pending_size = new_size;
+    }
+    memcpy(guest -> pending + guest -> pending_len, buf, size);
+    guest -> pending_len += size;
+    return size;
+}
+
+static size_t unsent(struct Guest *guest)
+{
+    return guest -> pending_len - guest -> pending_sent;
+}
+
+/*
+* Name: flush
+* Summary: sends as much of the guest's output as the socket takes without
+*          blocking.
+* Output: returns 0, or -1 if the client is gone.
+*/
+static int flush(struct Guest *guest)
+{
+    fflush(guest -> out);
+    while (unsent(guest) > 0) {
+        ssize_t n = send(guest -> fd, guest -> pending + guest -> pending_sent,
+                         unsent(guest), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        guest -> pending_sent += n;
+    }
+
+    if (guest -> pending_sent > 0) {
+        memmove(guest -> pending, guest -> pending + guest -> pending_sent,
+                unsent(guest));
+        guest -> pending_len = unsent(guest);
+        guest -> pending_sent = 0;
+    }
+    return 0;
+}
+
+/*
+* Name: receive
+* Summary: reads what the client has sent into the guest's input buffer.
+*/
+static void receive(struct Guest *guest)
+{
+    if (guest -> in_tail == IN_SIZE) {
+        return;
+    }
+
+    ssize_t n = recv(guest -> fd, guest -> in + guest -> in_tail,
+                     IN_SIZE - guest -> in_tail, 0);
+    if (n > 0) {
+        guest -> in_tail += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+                          && errno != EINTR)) {
+        guest -> in_eof = 1;
+    }
+}
+
+/*
+* Name: watch
+* Summary: asks epoll for readability while the input buffer has room and
+*          for writability while output is unsent.
+*/
+static void watch(struct Server *server, struct Guest *guest)
+{
+    uint32_t events = 0;
+    if (!guest -> in_eof && guest -> in_tail < IN_SIZE) {
+        events |= EPOLLIN;
+    }
+    if (unsent(guest) > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == guest -> events) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = guest;
+    epoll_ctl(server -> epoll_fd, EPOLL_CTL_MOD, guest -> fd, &event);
+    guest -> events = events;
+}
+
+static Seq_T copy_program(Seq_T program)
+{
+    Seq_T seg0 = Seq_new(Seq_length(program));
+    assert(seg0 != NULL);
+    for (int i = 0; i < Seq_length(program); i++) {
+        Seq_addhi(seg0, Seq_get(program, i));
+    }
+    return seg0;
+}
+
+/*
+* Name: open_guest
+* Summary: creates a runnable guest for the client on fd.
+*/
+static void open_guest(struct Server *server, int fd)
+{
+    struct Guest *guest;
+    NEW0(guest);
+    assert(guest != NULL);
+    guest -> fd = fd;
+    guest -> state = GUEST_RUNNABLE;
+    guest -> events = EPOLLIN;
+
+    cookie_io_functions_t functions = { NULL, guest_write, NULL, NULL };
+    guest -> out = fopencookie(guest, "w", functions);
+    assert(guest -> out != NULL);
+
+    Um_input input = { guest_ready, guest_get, guest };
+    guest -> um = um_new(copy_program(server -> program), server -> mode,
+                         NULL, NULL, input, guest -> out);
+
+    struct epoll_event event;
+    event.events = guest -> events;
+    event.data.ptr = guest;
+    if (epoll_ctl(server -> epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        fprintf(stderr, "Could not watch client: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    guest -> next = server -> guests;
+    if (server -> guests != NULL) {
+        server -> guests -> prev = guest;
+    }
+    server -> guests = guest;
+    server -> num_guests++;
+}
+
+/*
+* Name: watch_listener
+* Summary: starts (on is 1) or stops (on is 0) watching the listening
+*          socket for connections.
+*/
+static void watch_listener(struct Server *server, int on)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(server -> epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+              server -> listen_fd, &event);
+    server -> paused = !on;
+}
+
+/*
+* Name: close_guest
+* Summary: disconnects the client and frees its guest, whatever state the
+*          guest is in.
+*/
+static void close_guest(struct Server *server, struct Guest *guest)
+{
+    if (guest -> prev != NULL) {
+        guest -> prev -> next = guest -> next;
+    } else {
+        server -> guests = guest -> next;
+    }
+    if (guest -> next != NULL) {
+        guest -> next -> prev = guest -> prev;
+    }
+    server -> num_guests--;
+
+    close(guest -> fd);
+    fclose(guest -> out);
+    um_free(&guest -> um);
+    if (guest -> pending != NULL) {
+        FREE(guest -> pending);
+    }
+    FREE(guest);
+
+    if (server -> paused) {
+        watch_listener(server, 1);
+    }
+}
+
+/*
+* Name: shed_client
+* Summary: called when accept fails with EMFILE or ENFILE. The connection
+*          stays queued and the listener readable, so epoll would wake the
+*          loop at once, forever. The spare fd is closed to make room, the
+*          connection is accepted and dropped and the spare is reopened.
+* Output: returns 1 if a connection was dropped. Otherwise returns 0, and
+*         if there was no room even so the listener is not watched until
+*         a guest closes or a wait on epoll times out.
+*/
+static int shed_client(struct Server *server)
+{
+    int fd = -1;
+    int error = EMFILE;
+
+    if (server -> spare_fd >= 0) {
+        close(server -> spare_fd);
+        fd = accept(server -> listen_fd, NULL, NULL);
+        error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    server -> spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        return 1;
+    }
+    if (error == EMFILE || error == ENFILE) {
+        watch_listener(server, 0);
+    }
+    return 0;
+}
+
+/*
+* Name: accept_clients
+* Summary: accepts every pending connection. Clients over max_guests, or
+*          for whom there are no file descriptors left, are closed at once.
+*/
+static void accept_clients(struct Server *server)
+{
+    for (;;) {
+        int fd = accept4(server -> listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if ((errno == EMFILE || errno == ENFILE)
+                && shed_client(server)) {
+                continue;
+            }
+            return;
+        }
+        if (server -> num_guests == server -> max_guests) {
+            close(fd);
+            continue;
+        }
+        if (server -> tcp) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        open_guest(server, fd);
+    }
+}
+
+/*
+* Name: client_event
+* Summary: handles epoll events on a client socket and wakes the guest if
+*          what it was waiting for has happened.
+*/
+static void client_event(struct Server *server, struct Guest *guest,
+                         uint32_t events)
+{
+    if ((events & (EPOLLERR | EPOLLHUP)) != 0) {
+        close_guest(server, guest);
+        return;
+    }
+
+    if ((events & EPOLLIN) != 0) {
+        receive(guest);
+        if (guest -> state == GUEST_INPUT && guest_ready(guest)) {
+            guest -> state = GUEST_RUNNABLE;
+        }
+    }
+    if ((events & EPOLLOUT) != 0) {
+        if (flush(guest) != 0) {
+            close_guest(server, guest);
+            return;
+        }
+        if (guest -> state == GUEST_OUTPUT && unsent(guest) <= OUT_LIMIT) {
+            guest -> state = GUEST_RUNNABLE;
+        } else if (guest -> state == GUEST_CLOSING && unsent(guest) == 0) {
+            close_guest(server, guest);
+            return;
+        }
+    }
+    watch(server, guest);
+}
+
+/*
+* Name: run_turn
+* Summary: runs the guest for one turn of quantum instructions. A CRE in
+*          the guest fails a CII assert, which raises Assert_Failed; it is
+*          caught here so that only this guest is lost, not the server.
+* Output: returns 1 if the guest failed, else 0 with its status in *status.
+* Error Conditions: the failed guest may leak what its last instruction
+*                   had allocated; it must only be closed.
+*/
+static int run_turn(struct Guest *guest, uint64_t quantum, Um_status *status)
+{
+    volatile int failed = 0;
+
+    TRY
+        *status = um_run(guest -> um, quantum);
+    EXCEPT(Assert_Failed)
+        failed = 1;
+    END_TRY;
+    return failed;
+}
+
+/*
+* Name: run_guests
+* Summary: gives every runnable guest one turn of quantum instructions.
+*          A guest that fails with a CRE is closed; the rest run on.
+* Output: returns the number of guests still runnable.
+*/
+static int run_guests(struct Server *server, uint64_t quantum)
+{
+    int runnable = 0;
+    struct Guest *next;
+
+    for (struct Guest *guest = server -> guests; guest != NULL;
+         guest = next) {
+        next = guest -> next;
+        if (guest -> state != GUEST_RUNNABLE) {
+            continue;
+        }
+
+        Um_status status;
+        if (run_turn(guest, quantum, &status) != 0) {
+            fprintf(stderr, "Guest failed, closing its client\n");
+            flush(guest);
+            close_guest(server, guest);
+            continue;
+        }
+        if (flush(guest) != 0) {
+            close_guest(server, guest);
+            continue;
+        }
+
+        if (status == UM_HALTED) {
+            guest -> state = GUEST_CLOSING;
+            if (unsent(guest) == 0) {
+                close_guest(server, guest);
+                continue;
+            }
+        } else if (status == UM_BLOCKED) {
+            guest -> state = GUEST_INPUT;
+        } else if (unsent(guest) > OUT_LIMIT) {
+            guest -> state = GUEST_OUTPUT;
+        } else {
+            runnable++;
+        }
+        watch(server, guest);
+    }
+    return runnable;
+}
+
+/*
+* Name: listen_on
+* Summary: creates the non blocking listening socket for address and
+*          reports where it listens on standard error.
+* Error Conditions: exits with EXIT_FAILURE if address is malformed or
+*                   cannot be listened on.
+*/
+static void listen_on(struct Server *server, const char *address)
+{
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address + 5) == 0
+            || strlen(address + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Bad socket path in %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(addr.sun_path, address + 5);
+
+        struct stat buf;
+        if (lstat(addr.sun_path, &buf) == 0) {
+            if (!S_ISSOCK(buf.st_mode)) {
+                fprintf(stderr, "Could not listen on %s: not a socket\n",
+                        address);
+                exit(EXIT_FAILURE);
+            }
+            unlink(addr.sun_path);
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(fd, SOMAXCONN) != 0) {
+            fprintf(stderr, "Could not listen on %s: %s\n", address,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        server -> unix_path = address + 5;
+        fprintf(stderr, "Listening on %s\n", address);
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        char host[256] = "127.0.0.1";
+        const char *port = strrchr(address + 4, ':');
+        if (port == NULL) {
+            port = address + 4;
+        } else {
+            size_t length = port - (address + 4);
+            if (length == 0 || length >= sizeof(host)) {
+                fprintf(stderr, "Bad host in %s\n", address);
+                exit(EXIT_FAILURE);
+            }
+            memcpy(host, address + 4, length);
+            host[length] = '\0';
+            port++;
+        }
+
+        struct addrinfo hints, *addrs;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int error = getaddrinfo(host, port, &hints, &addrs);
+        if (error != 0) {
+            fprintf(stderr, "Bad address %s: %s\n", address,
+                    gai_strerror(error));
+            exit(EXIT_FAILURE);
+        }
+
+        for (struct addrinfo *a = addrs; a != NULL && fd < 0;
+             a = a -> ai_next) {
+            fd = socket(a -> ai_family, a -> ai_socktype | SOCK_NONBLOCK
+                        | SOCK_CLOEXEC, a -> ai_protocol);
+            int on = 1;
+            if (fd >= 0
+                && (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+                               sizeof(on)) != 0
+                    || bind(fd, a -> ai_addr, a -> ai_addrlen) != 0
+                    || listen(fd, SOMAXCONN) != 0)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+        if (fd < 0) {
+            fprintf(stderr, "Could not listen on %s: %s\n", address,
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        struct sockaddr_storage bound;
+        socklen_t length = sizeof(bound);
+        char bound_host[NI_MAXHOST], bound_port[NI_MAXSERV];
+        getsockname(fd, (struct sockaddr *) &bound, &length);
+        getnameinfo((struct sockaddr *) &bound, length, bound_host,
+                    sizeof(bound_host), bound_port, sizeof(bound_port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+        server -> tcp = 1;
+        fprintf(stderr, "Listening on tcp:%s:%s\n", bound_host, bound_port);
+    } else {
+        fprintf(stderr, "Address %s is not unix:<path> or "
+                        "tcp:[<host>:]<port>\n", address);
+        exit(EXIT_FAILURE);
+    }
+
+    server -> listen_fd = fd;
+}
+
+/*
+* Name: raise_file_limit
+* Summary: raises the soft limit on open files as far as the hard limit
+*          allows, so max_guests clients can be served.
+*/
+static void raise_file_limit(int max_guests)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+    rlim_t wanted = (rlim_t) max_guests + 16;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        limit.rlim_cur = limit.rlim_max == RLIM_INFINITY
+                         || limit.rlim_max > wanted ? wanted : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/*
+* Name: serve
+* Summary: listens on address and runs guests of program for clients until
+*          SIGINT or SIGTERM, then closes every client.
+* Input: as described in serve.h.
+* Output: N/A
+* Side Effects: creates the socket and installs handlers for SIGINT and
+*               SIGTERM. A stale Unix socket at the path is removed first
+*               and the socket is removed when done; any other file at the
+*               path is left alone and serve fails.
+* Error Conditions: CRE if program is NULL, max_guests or quantum is 0.
+*                   exits with EXIT_FAILURE if the socket cannot be made.
+*/
+void serve(const char *address, Seq_T program, Accel_mode mode,
+           int max_guests, uint64_t quantum)
+{
+    assert(address != NULL && program != NULL);
+    assert(max_guests > 0 && quantum != 0);
+
+    struct Server server;
+    memset(&server, 0, sizeof(server));
+    server.program = program;
+    server.mode = mode;
+    server.max_guests = max_guests;
+
+    raise_file_limit(max_guests);
+    listen_on(&server, address);
+    server.spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (server.epoll_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD,
+                                         server.listen_fd, &event) != 0) {
+        fprintf(stderr, "Could not create epoll: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct epoll_event events[MAX_EVENTS];
+    int runnable = 0;
+
+    while (!stopping) {
+        int n = epoll_wait(server.epoll_fd, events, MAX_EVENTS,
+                           runnable > 0 ? 0 : server.paused ? PAUSE_MS : -1);
+        if (n == 0 && server.paused) {
+            watch_listener(&server, 1);
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(&server);
+            } else {
+                client_event(&server, events[i].data.ptr, events[i].events);
+            }
+        }
+        runnable = run_guests(&server, quantum);
+    }
+
+    while (server.guests != NULL) {
+        close_guest(&server, server.guests);
+    }
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    if (server.spare_fd >= 0) {
+        close(server.spare_fd);
+    }
+    if (server.unix_path != NULL) {
+        unlink(server.unix_path);
+    }
+}
@@ -0,0 +1,39 @@
+/*
+*                       serve.h
+*
+*
+*   Summary: Interface for serve. serve listens on a Unix domain or TCP
+*            socket and runs a fresh guest of the program for every client
+*            that connects, with the guest's IN reading from and OUT
+*            writing to that client. All guests share one thread and one
+*            epoll loop: a guest at an IN with no byte ready is suspended
+*            until its socket is readable, and its output is sent in large
+*            batched writes.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#ifndef SERVE_READER
+#define SERVE_READER
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "seq.h"
+#include "accel.h"
+
+/*
+* Name: serve
+* Usage: called by main for --serve. Serves guests until SIGINT or SIGTERM.
+* Expected Input: address is "unix:<path>" or "tcp:[<host>:]<port>" (host
+*                 defaults to 127.0.0.1, port 0 picks a free port), program
+*                 is segment 0 as read in and is copied for every guest,
+*                 mode is as for um(), max_guests is the most clients
+*                 served at once (more are closed at once) and quantum is
+*                 the guest instructions run before the next guest's turn.
+*/
+extern void serve(const char *address, Seq_T program, Accel_mode mode,
+                  int max_guests, uint64_t quantum);
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+#                       serve_test.sh
+#
+#   Summary: loopback test for ./um --serve. Serves serve_fault.um on a
+#            free TCP port and connects two clients. The first sends a '0',
+#            which fails its guest with a CRE; the second must still have
+#            its input echoed, before and after, by a server that is still
+#            running.
+#
+#            Usage: ./serve_test.sh [um flags...]
+#
+#   Authors: vmccab01 and pdlami01
+
+log=$(mktemp)
+./um "$@" --serve=tcp:127.0.0.1:0 serve_fault.um 2> "$log" &
+server=$!
+trap 'kill $server 2> /dev/null; rm -f "$log"' EXIT
+
+fail()
+{
+    echo "serve_test: $1" >&2
+    cat "$log" >&2
+    exit 1
+}
+
+for i in $(seq 50); do
+    port=$(sed -n 's/^Listening on tcp:.*:\([0-9]*\)$/\1/p' "$log")
+    [ -n "$port" ] && break
+    sleep 0.1
+done
+[ -n "$port" ] || fail "server did not start"
+
+exec 3<> "/dev/tcp/127.0.0.1/$port" || fail "could not connect"
+exec 4<> "/dev/tcp/127.0.0.1/$port" || fail "could not connect"
+
+printf '12' >&3
+read -r -N 2 -t 5 got <&3
+[ "$got" = "12" ] || fail "echo before the fault gave '$got'"
+
+printf '0' >&4
+read -r -N 1 -t 5 got <&4
+[ $? -eq 1 ] && [ -z "$got" ] || fail "failed guest's client was not closed"
+exec 4<&-
+
+printf '34' >&3
+read -r -N 2 -t 5 got <&3
+[ "$got" = "34" ] || fail "echo after the fault gave '$got'"
+exec 3<&-
+
+kill -0 $server 2> /dev/null || fail "server died"
+echo "serve_test: ok"
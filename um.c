@@ -12,32 +12,112 @@
 #include <unistd.h>
 #include <stdlib.h> 
 #include <stdio.h>
+#include <string.h>
 
 
 #include "seq.h"
 #include "um_reader.h"
 #include "execute.h"
+#include "perfctr.h"
+#include "metrics.h"
+#include "serve.h"
+
+const char *usage = "Usage: ./um [--accel | --accel-verify] "
+                    "[--perf=<report> [--perf-every=<n>]] "
+                    "[--stats [--stats-every=<n>]] "
+                    "[--serve=<address> [--guests=<n>] [--quantum=<n>]] "
+                    "<program.um> \n";
 
 int main(int argc, char *argv[]) {
 
-    if (argc == 2) {
+    Accel_mode mode = ACCEL_OFF;
+    const char *engines[] = { "interpreter", "accel", "accel-verify" };
+    const char *perf_file = NULL;
+    uint64_t perf_every = 1000000;
+    int stats = 0;
+    uint64_t stats_every = 65536;
+    const char *address = NULL;
+    int max_guests = 1024;
+    uint64_t quantum = 65536;
+
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--accel") == 0) {
+            mode = ACCEL_ON;
+        } else if (strcmp(argv[i], "--accel-verify") == 0) {
+            mode = ACCEL_VERIFY;
+        } else if (strncmp(argv[i], "--perf=", 7) == 0) {
+            perf_file = argv[i] + 7;
+        } else if (strncmp(argv[i], "--perf-every=", 13) == 0) {
+            perf_every = strtoull(argv[i] + 13, NULL, 10);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strncmp(argv[i], "--stats-every=", 14) == 0) {
+            stats_every = strtoull(argv[i] + 14, NULL, 10);
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            address = argv[i] + 8;
+        } else if (strncmp(argv[i], "--guests=", 9) == 0) {
+            max_guests = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--quantum=", 10) == 0) {
+            quantum = strtoull(argv[i] + 10, NULL, 10);
+        } else {
+            fprintf(stderr, "%s", usage);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (address != NULL && (perf_file != NULL || stats)) {
+        fprintf(stderr, "--perf and --stats cannot be used with --serve\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (argc >= 2 && perf_every != 0 && stats_every != 0 && max_guests > 0
+        && quantum != 0) {
 
+        const char *program = argv[argc - 1];
         struct stat buf;
-        stat(argv[1], &buf);
-        FILE *fp = fopen(argv[1], "rb");
+        stat(program, &buf);
+        FILE *fp = fopen(program, "rb");
 
         if(fp == NULL) {
-            fprintf(stderr, "Could not open %s\n", argv[1]);
+            fprintf(stderr, "Could not open %s\n", program);
             exit(EXIT_FAILURE);
         }
+
+        FILE *report = NULL;
+        Perfctr_T perf = NULL;
+        if (perf_file != NULL) {
+            report = fopen(perf_file, "w");
+            if (report == NULL) {
+                fprintf(stderr, "Could not open %s\n", perf_file);
+                exit(EXIT_FAILURE);
+            }
+            perf = perfctr_new(report, perf_every, engines[mode]);
+        }
+
+        Metrics_T metrics = NULL;
+        if (stats) {
+            metrics = metrics_new(stats_every);
+        }
         
         Seq_T seg0 = reader(fp, buf.st_size);
-        um(seg0);
+        if (address != NULL) {
+            serve(address, seg0, mode, max_guests, quantum);
+            Seq_free(&seg0);
+        } else {
+            um(seg0, mode, perf, metrics);
+        }
 
+        if (metrics != NULL) {
+            metrics_free(&metrics);
+        }
+        if (perf != NULL) {
+            perfctr_free(&perf);
+            fclose(report);
+        }
         fclose(fp);
         return EXIT_SUCCESS;
     }
     
-    fprintf(stderr, "Usage: ./um <program.um> \n");
+    fprintf(stderr, "%s", usage);
     exit(EXIT_FAILURE);
 }
\ No newline at end of file
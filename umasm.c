@@ -0,0 +1,776 @@
+/*
+*                       umasm.c
+*
+*
+*   Summary: umasm.c holds the main for umasm, an assembler for .um
+*            programs. Mnemonics are the Um_opcode names from execute.h in
+*            lower case (plus map/unmap for activate/inactivate), operands
+*            are registers r0-r7 and expressions over numbers, character
+*            literals, labels and .equ symbols joined by + and -, with an
+*            optional leading sign.
+*
+*            Usage: ./umasm [-o <program.um>] [<source.ums>]
+*
+*            Source syntax, one statement per line, ';' or '#' comments:
+*
+*                label:  add r1, r2, r3        rA, rB, rC as in execute.c
+*                        lv r1, label + 2       25 bit value
+*                        map r2, r3             r2 gets a segment of r3
+*                        unmap r2 / out r2 / in r2 / loadp r1, r2 / halt
+*                        .equ N, 1000
+*                        .word expr / .space n / .string "text\n"
+*                        .macro name a, b       \a, \b are the arguments,
+*                        ...                    \@ is unique per expansion
+*                        .endm
+*
+*            Macros are expanded and labels given addresses in a first
+*            pass; a second pass encodes every statement.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+#include <mem.h>
+
+#include "seq.h"
+#include "table.h"
+#include "atom.h"
+#include "bitpack.h"
+#include "execute.h"
+
+#define MAX_DEPTH 64
+#define MAX_ARGS 16
+
+const uint32_t lv_max = (1 << 25) - 1;
+
+/*
+* A source line. Expanded statements are Lines too, with the file and line
+* of the statement (or macro call) they came from.
+*/
+struct Line {
+    const char *file;
+    int number;
+    char *text;
+};
+
+struct Macro {
+    const char *name;
+    int num_params;
+    const char *params[MAX_ARGS];
+    Seq_T body;
+};
+
+struct Symbol {
+    uint32_t value;
+};
+
+struct Assembler {
+    Table_T macros;
+    Table_T symbols;
+    Seq_T statements;
+    uint32_t address;
+    int expansions;
+};
+
+static const struct Mnemonic {
+    const char *name;
+    Um_opcode opcode;
+    const char *operands;
+} mnemonics[] = {
+    { "cmov",       CMOV,       "abc" },
+    { "sload",      SLOAD,      "abc" },
+    { "sstore",     SSTORE,     "abc" },
+    { "add",        ADD,        "abc" },
+    { "mul",        MUL,        "abc" },
+    { "div",        DIV,        "abc" },
+    { "nand",       NAND,       "abc" },
+    { "halt",       HALT,       ""    },
+    { "activate",   ACTIVATE,   "bc"  },
+    { "map",        ACTIVATE,   "bc"  },
+    { "inactivate", INACTIVATE, "c"   },
+    { "unmap",      INACTIVATE, "c"   },
+    { "out",        OUT,        "c"   },
+    { "in",         IN,         "c"   },
+    { "loadp",      LOADP,      "bc"  },
+    { "lv",         LV,         "av"  }
+};
+
+static const int num_mnemonics = sizeof(mnemonics) / sizeof(mnemonics[0]);
+
+/*
+* Name: error
+* Summary: reports an error at line and exits.
+*/
+static void error(struct Line *line, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%s:%d: ", line -> file, line -> number);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static struct Line *new_line(const char *file, int number, const char *text)
+{
+    struct Line *line;
+    NEW(line);
+    assert(line != NULL);
+    line -> file = file;
+    line -> number = number;
+    line -> text = ALLOC(strlen(text) + 1);
+    strcpy(line -> text, text);
+    return line;
+}
+
+static void free_lines(Seq_T *lines)
+{
+    while (Seq_length(*lines) > 0) {
+        struct Line *line = Seq_remhi(*lines);
+        FREE(line -> text);
+        FREE(line);
+    }
+    Seq_free(lines);
+}
+
+static int is_ident_start(int c)
+{
+    return isalpha(c) || c == '_' || c == '.';
+}
+
+static int is_ident(int c)
+{
+    return isalnum(c) || c == '_' || c == '.';
+}
+
+static char *skip_space(char *s)
+{
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+    return s;
+}
+
+/*
+* Name: trim
+* Summary: cuts the comment off text and strips surrounding white space.
+*          Comment characters inside string and character literals are
+*          kept.
+*/
+static char *trim(char *text)
+{
+    char quote = 0;
+    for (char *s = text; *s != '\0'; s++) {
+        if (quote != 0) {
+            if (*s == '\\' && s[1] != '\0') {
+                s++;
+            } else if (*s == quote) {
+                quote = 0;
+            }
+        } else if (*s == '"' || *s == '\'') {
+            quote = *s;
+        } else if (*s == ';' || *s == '#') {
+            *s = '\0';
+            break;
+        }
+    }
+
+    text = skip_space(text);
+    size_t length = strlen(text);
+    while (length > 0 && isspace((unsigned char) text[length - 1])) {
+        text[--length] = '\0';
+    }
+    return text;
+}
+
+/*
+* Name: ident
+* Summary: reads an identifier at *s into an atom and moves *s past it.
+* Output: the atom, or NULL if *s does not start an identifier.
+*/
+static const char *ident(char **s)
+{
+    char *start = *s;
+    if (!is_ident_start((unsigned char) *start)) {
+        return NULL;
+    }
+    while (is_ident((unsigned char) **s)) {
+        (*s)++;
+    }
+    return Atom_new(start, *s - start);
+}
+
+/*
+* Name: split
+* Summary: splits text at top level commas into at most MAX_ARGS trimmed
+*          operands, in place.
+* Output: the number of operands.
+*/
+static int split(struct Line *line, char *text, char **operands)
+{
+    int count = 0;
+    char quote = 0;
+    text = skip_space(text);
+    if (*text == '\0') {
+        return 0;
+    }
+
+    operands[count++] = text;
+    for (char *s = text; *s != '\0'; s++) {
+        if (quote != 0) {
+            if (*s == '\\' && s[1] != '\0') {
+                s++;
+            } else if (*s == quote) {
+                quote = 0;
+            }
+        } else if (*s == '"' || *s == '\'') {
+            quote = *s;
+        } else if (*s == ',') {
+            if (count == MAX_ARGS) {
+                error(line, "too many operands");
+            }
+            *s = '\0';
+            operands[count++] = s + 1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        operands[i] = trim(operands[i]);
+    }
+    return count;
+}
+
+/*
+* Name: escape
+* Summary: reads one possibly escaped character of a literal at *s.
+*/
+static uint32_t escape(struct Line *line, char **s)
+{
+    char c = *(*s)++;
+    if (c == '\0') {
+        error(line, "unterminated literal");
+    }
+    if (c != '\\') {
+        return (unsigned char) c;
+    }
+
+    c = *(*s)++;
+    switch (c) {
+        case 'n':  return '\n';
+        case 't':  return '\t';
+        case 'r':  return '\r';
+        case '0':  return '\0';
+        case '\\': return '\\';
+        case '\'': return '\'';
+        case '"':  return '"';
+        default:
+            error(line, "unknown escape \\%c", c);
+            return 0;
+    }
+}
+
+/*
+* Name: string_words
+* Summary: decodes the string literal text. If words is non NULL each
+*          character is stored in it.
+* Output: the number of characters.
+*/
+static uint32_t string_words(struct Line *line, char *text, uint32_t *words)
+{
+    if (*text != '"') {
+        error(line, "expected a string literal");
+    }
+    text++;
+
+    uint32_t count = 0;
+    while (*text != '"') {
+        uint32_t c = escape(line, &text);
+        if (words != NULL) {
+            words[count] = c;
+        }
+        count++;
+    }
+    if (*skip_space(text + 1) != '\0') {
+        error(line, "junk after string literal");
+    }
+    return count;
+}
+
+/*
+* Name: evaluate
+* Summary: evaluates an expression of numbers, character literals and
+*          symbols joined by + and -, with 32 bit wrap around. Each
+*          number must fit in 32 bits. The first term may have a sign of
+*          its own, so -1 is 0xffffffff. Symbols must be defined before
+*          they are used, except labels, which are all known by the
+*          second pass.
+* Output: the value.
+*/
+static uint32_t evaluate(struct Assembler *as, struct Line *line, char *text)
+{
+    uint32_t value = 0;
+    int sign = 1;
+    char *s = skip_space(text);
+
+    if (*s == '\0') {
+        error(line, "missing expression");
+    }
+    if (*s == '-' || *s == '+') {
+        sign = *s == '-' ? -1 : 1;
+        s++;
+    }
+
+    for (;;) {
+        uint32_t term = 0;
+        s = skip_space(s);
+
+        if (isdigit((unsigned char) *s)) {
+            char *end;
+            errno = 0;
+            unsigned long number = strtoul(s, &end, 0);
+            if (errno == ERANGE || number > UINT32_MAX) {
+                error(line, "number %.*s does not fit in 32 bits",
+                      (int) (end - s), s);
+            }
+            term = (uint32_t) number;
+            s = end;
+        } else if (*s == '\'') {
+            s++;
+            term = escape(line, &s);
+            if (*s++ != '\'') {
+                error(line, "unterminated character literal");
+            }
+        } else {
+            const char *name = ident(&s);
+            if (name == NULL) {
+                error(line, "bad expression '%s'", text);
+            }
+            struct Symbol *symbol = Table_get(as -> symbols, name);
+            if (symbol == NULL) {
+                error(line, "undefined symbol '%s'", name);
+            }
+            term = symbol -> value;
+        }
+
+        value = sign > 0 ? value + term : value - term;
+
+        s = skip_space(s);
+        if (*s == '\0') {
+            return value;
+        } else if (*s == '+') {
+            sign = 1;
+        } else if (*s == '-') {
+            sign = -1;
+        } else {
+            error(line, "bad expression '%s'", text);
+        }
+        s++;
+    }
+}
+
+static void define(struct Assembler *as, struct Line *line, const char *name,
+                   uint32_t value)
+{
+    if (Table_get(as -> symbols, name) != NULL) {
+        error(line, "'%s' is already defined", name);
+    }
+    struct Symbol *symbol;
+    NEW(symbol);
+    assert(symbol != NULL);
+    symbol -> value = value;
+    Table_put(as -> symbols, name, symbol);
+}
+
+static uint32_t reg(struct Line *line, char *text)
+{
+    if ((text[0] != 'r' && text[0] != 'R') || text[1] < '0' || text[1] > '7'
+        || text[2] != '\0') {
+        error(line, "expected a register r0-r7, got '%s'", text);
+    }
+    return text[1] - '0';
+}
+
+static const struct Mnemonic *find_mnemonic(const char *name)
+{
+    for (int i = 0; i < num_mnemonics; i++) {
+        if (strcasecmp(mnemonics[i].name, name) == 0) {
+            return &mnemonics[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+* Name: substitute
+* Summary: returns a copy of text with \param replaced by the matching
+*          argument and \@ by the expansion number.
+*/
+static char *substitute(struct Line *line, const char *text,
+                        struct Macro *macro, char **args, int expansion)
+{
+    size_t size = strlen(text) + 1;
+    size_t length = 0;
+    char *out = ALLOC(size);
+
+    for (const char *s = text; *s != '\0'; ) {
+        const char *piece = s;
+        size_t piece_length = 1;
+        char number[16];
+
+        if (s[0] == '\\' && s[1] == '@') {
+            snprintf(number, sizeof(number), "%d", expansion);
+            piece = number;
+            piece_length = strlen(number);
+            s += 2;
+        } else if (s[0] == '\\' && is_ident_start((unsigned char) s[1])) {
+            char *end = (char *) s + 1;
+            const char *name = ident(&end);
+            int i = 0;
+            while (i < macro -> num_params && macro -> params[i] != name) {
+                i++;
+            }
+            if (i == macro -> num_params) {
+                error(line, "'%s' is not a parameter of %s", name,
+                      macro -> name);
+            }
+            piece = args[i];
+            piece_length = strlen(args[i]);
+            s = end;
+        } else {
+            s++;
+        }
+
+        if (length + piece_length + 1 > size) {
+            size = 2 * (length + piece_length + 1);
+            RESIZE(out, size);
+        }
+        memcpy(out + length, piece, piece_length);
+        length += piece_length;
+    }
+    out[length] = '\0';
+    return out;
+}
+
+static void assemble_lines(struct Assembler *as, Seq_T lines, int depth);
+
+/*
+* Name: statement
+* Summary: first pass over one statement with its labels already removed:
+*          defines .equ symbols, expands macro calls and records everything
+*          else with the number of words it takes.
+*/
+static void statement(struct Assembler *as, struct Line *line, char *text,
+                      int depth)
+{
+    char *s = text;
+    const char *name = ident(&s);
+    if (name == NULL) {
+        error(line, "expected a statement, got '%s'", text);
+    }
+
+    char *operands[MAX_ARGS];
+    struct Macro *macro = Table_get(as -> macros, name);
+
+    if (macro != NULL) {
+        if (depth == MAX_DEPTH) {
+            error(line, "macros nested too deeply in %s", name);
+        }
+        int count = split(line, s, operands);
+        if (count != macro -> num_params) {
+            error(line, "%s takes %d arguments, got %d", name,
+                  macro -> num_params, count);
+        }
+
+        int expansion = as -> expansions++;
+        Seq_T body = Seq_new(Seq_length(macro -> body));
+        for (int i = 0; i < Seq_length(macro -> body); i++) {
+            struct Line *curr = Seq_get(macro -> body, i);
+            char *expanded = substitute(line, curr -> text, macro, operands,
+                                        expansion);
+            Seq_addhi(body, new_line(line -> file, line -> number, expanded));
+            FREE(expanded);
+        }
+        assemble_lines(as, body, depth + 1);
+        free_lines(&body);
+        return;
+    }
+
+    if (strcmp(name, ".equ") == 0) {
+        if (split(line, s, operands) != 2) {
+            error(line, ".equ takes a name and a value");
+        }
+        char *equ = operands[0];
+        const char *symbol = ident(&equ);
+        if (symbol == NULL || *equ != '\0') {
+            error(line, "bad .equ name '%s'", operands[0]);
+        }
+        define(as, line, symbol, evaluate(as, line, operands[1]));
+        return;
+    }
+
+    uint32_t words = 1;
+    if (strcmp(name, ".space") == 0) {
+        words = evaluate(as, line, s);
+    } else if (strcmp(name, ".string") == 0) {
+        words = string_words(line, skip_space(s), NULL);
+    } else if (strcmp(name, ".word") != 0 && find_mnemonic(name) == NULL) {
+        error(line, "unknown instruction or macro '%s'", name);
+    }
+
+    struct Line *curr = new_line(line -> file, line -> number, text);
+    Seq_addhi(as -> statements, curr);
+    as -> address += words;
+}
+
+/*
+* Name: assemble_lines
+* Summary: first pass over lines: collects .macro definitions, defines
+*          labels at the current address and hands each statement to
+*          statement().
+*/
+static void assemble_lines(struct Assembler *as, Seq_T lines, int depth)
+{
+    for (int i = 0; i < Seq_length(lines); i++) {
+        struct Line *line = Seq_get(lines, i);
+        char *copy = ALLOC(strlen(line -> text) + 1);
+        strcpy(copy, line -> text);
+        char *text = trim(copy);
+
+        if (strncmp(text, ".macro", 6) == 0 && !is_ident(text[6])) {
+            struct Macro *macro;
+            NEW0(macro);
+            assert(macro != NULL);
+
+            char *s = skip_space(text + 6);
+            macro -> name = ident(&s);
+            if (macro -> name == NULL) {
+                error(line, "missing macro name");
+            }
+            char *params[MAX_ARGS];
+            macro -> num_params = split(line, s, params);
+            for (int j = 0; j < macro -> num_params; j++) {
+                char *p = params[j];
+                macro -> params[j] = ident(&p);
+                if (macro -> params[j] == NULL || *p != '\0') {
+                    error(line, "bad parameter '%s'", params[j]);
+                }
+            }
+
+            macro -> body = Seq_new(16);
+            for (i++; i < Seq_length(lines); i++) {
+                struct Line *curr = Seq_get(lines, i);
+                char *end = skip_space(curr -> text);
+                if (strncmp(end, ".endm", 5) == 0 && !is_ident(end[5])) {
+                    break;
+                }
+                Seq_addhi(macro -> body, new_line(curr -> file,
+                                                  curr -> number,
+                                                  curr -> text));
+            }
+            if (i == Seq_length(lines)) {
+                error(line, "missing .endm for %s", macro -> name);
+            }
+            if (Table_put(as -> macros, macro -> name, macro) != NULL) {
+                error(line, "macro %s is already defined", macro -> name);
+            }
+            FREE(copy);
+            continue;
+        }
+
+        for (;;) {
+            char *s = text;
+            const char *label = ident(&s);
+            s = skip_space(s);
+            if (label == NULL || *s != ':') {
+                break;
+            }
+            define(as, line, label, as -> address);
+            text = skip_space(s + 1);
+        }
+
+        if (*text != '\0') {
+            statement(as, line, text, depth);
+        }
+        FREE(copy);
+    }
+}
+
+/*
+* Name: encode
+* Summary: second pass over one statement. Appends its words to program.
+*/
+static void encode(struct Assembler *as, struct Line *line, Seq_T program)
+{
+    char *copy = ALLOC(strlen(line -> text) + 1);
+    strcpy(copy, line -> text);
+    char *s = copy;
+    const char *name = ident(&s);
+    char *operands[MAX_ARGS];
+
+    if (strcmp(name, ".word") == 0) {
+        Seq_addhi(program, (void *) (uintptr_t) evaluate(as, line, s));
+    } else if (strcmp(name, ".space") == 0) {
+        uint32_t words = evaluate(as, line, s);
+        for (uint32_t i = 0; i < words; i++) {
+            Seq_addhi(program, (void *) (uintptr_t) 0);
+        }
+    } else if (strcmp(name, ".string") == 0) {
+        s = skip_space(s);
+        uint32_t length = string_words(line, s, NULL);
+        uint32_t *words = CALLOC(length + 1, sizeof(uint32_t));
+        string_words(line, s, words);
+        for (uint32_t i = 0; i < length; i++) {
+            Seq_addhi(program, (void *) (uintptr_t) words[i]);
+        }
+        FREE(words);
+    } else {
+        const struct Mnemonic *mnemonic = find_mnemonic(name);
+        int count = split(line, s, operands);
+        int expected = strlen(mnemonic -> operands);
+        if (count != expected) {
+            error(line, "%s takes %d operands, got %d", mnemonic -> name,
+                  expected, count);
+        }
+
+        uint64_t word = Bitpack_newu(0, 4, 28, mnemonic -> opcode);
+        for (int i = 0; i < count; i++) {
+            switch (mnemonic -> operands[i]) {
+                case 'a':
+                    word = mnemonic -> opcode == LV
+                           ? Bitpack_newu(word, 3, 25, reg(line, operands[i]))
+                           : Bitpack_newu(word, 3, 6, reg(line, operands[i]));
+                    break;
+                case 'b':
+                    word = Bitpack_newu(word, 3, 3, reg(line, operands[i]));
+                    break;
+                case 'c':
+                    word = Bitpack_newu(word, 3, 0, reg(line, operands[i]));
+                    break;
+                case 'v':
+                {
+                    uint32_t value = evaluate(as, line, operands[i]);
+                    if (value > lv_max && (int32_t) value < 0) {
+                        error(line, "lv value %d does not fit in 25 bits",
+                              (int32_t) value);
+                    } else if (value > lv_max) {
+                        error(line, "lv value %u does not fit in 25 bits",
+                              value);
+                    }
+                    word = Bitpack_newu(word, 25, 0, value);
+                    break;
+                }
+            }
+        }
+        Seq_addhi(program, (void *) (uintptr_t) word);
+    }
+    FREE(copy);
+}
+
+/*
+* Name: read_lines
+* Summary: reads every line of fp into a sequence of Lines.
+*/
+static Seq_T read_lines(FILE *fp, const char *file)
+{
+    Seq_T lines = Seq_new(256);
+    char *text = NULL;
+    size_t size = 0;
+    int number = 0;
+
+    while (getline(&text, &size, fp) != -1) {
+        number++;
+        Seq_addhi(lines, new_line(file, number, text));
+    }
+    free(text);
+    return lines;
+}
+
+static void free_symbol(const void *key, void **value, void *cl)
+{
+    (void) key;
+    (void) cl;
+    FREE(*value);
+}
+
+static void free_macro(const void *key, void **value, void *cl)
+{
+    (void) key;
+    (void) cl;
+    struct Macro *macro = *value;
+    free_lines(&macro -> body);
+    FREE(macro);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *source = NULL;
+    const char *target = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            target = argv[++i];
+        } else if (source == NULL && argv[i][0] != '-') {
+            source = argv[i];
+        } else {
+            fprintf(stderr, "Usage: ./umasm [-o <program.um>] "
+                            "[<source.ums>] \n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FILE *in = source == NULL ? stdin : fopen(source, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s\n", source);
+        exit(EXIT_FAILURE);
+    }
+    Seq_T lines = read_lines(in, source == NULL ? "<stdin>" : source);
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    struct Assembler as;
+    as.macros = Table_new(0, NULL, NULL);
+    as.symbols = Table_new(0, NULL, NULL);
+    as.statements = Seq_new(256);
+    as.address = 0;
+    as.expansions = 0;
+
+    assemble_lines(&as, lines, 0);
+
+    Seq_T program = Seq_new(as.address + 1);
+    for (int i = 0; i < Seq_length(as.statements); i++) {
+        encode(&as, Seq_get(as.statements, i), program);
+    }
+
+    FILE *out = target == NULL ? stdout : fopen(target, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s\n", target);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < Seq_length(program); i++) {
+        uint32_t word = (uint32_t) (uintptr_t) Seq_get(program, i);
+        for (int lsb = 24; lsb >= 0; lsb -= 8) {
+            putc(Bitpack_getu(word, 8, lsb), out);
+        }
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    Seq_free(&program);
+    free_lines(&as.statements);
+    free_lines(&lines);
+    Table_map(as.symbols, free_symbol, NULL);
+    Table_map(as.macros, free_macro, NULL);
+    Table_free(&as.symbols);
+    Table_free(&as.macros);
+    return EXIT_SUCCESS;
+}
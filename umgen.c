@@ -0,0 +1,288 @@
+/*
+*                       umgen.c
+*
+*
+*   Summary: umgen.c holds the main for umgen, which prints umasm source
+*            for parameterised stress programs, so the interpreter, accel,
+*            perfctr and the allocator can be measured on workloads of a
+*            known shape and size:
+*
+*                alu <iterations>              add/mul/div/nand loop
+*                churn <depth> <rounds> [size] map depth segments, unmap
+*                                              them, repeat
+*                recurse <depth> <repeat>      LOADP used as call/return
+*                                              depth calls deep
+*                flood <lines>                 output loop over a string
+*                copy <words> <repeat>         word by word segment copy
+*                echo                          copies input to output
+*                                              until end of input
+*
+*            Usage: ./umgen <workload> <params...> | ./umasm -o w.um
+*
+*            Every program ends by printing "<workload> done\n". The flood
+*            and copy loops have the exact shape accel recognises.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define PARAM_MAX ((1 << 25) - 1)
+
+/*
+* The prelude every program starts with. r0 stays 0, r7 holds 1 and r6
+* holds -1 once setup has run.
+*/
+static const char *prelude =
+    "; generated by umgen\n"
+    ".macro setup\n"
+    "        lv r7, 1\n"
+    "        nand r6, r7, r7\n"
+    "        add r6, r6, r7\n"
+    ".endm\n"
+    "\n"
+    "; jumps to target if cnt is not zero\n"
+    ".macro loop_while cnt, target, t1, t2\n"
+    "        lv \\t1, next\\@\n"
+    "        lv \\t2, \\target\n"
+    "        cmov \\t1, \\t2, \\cnt\n"
+    "        loadp r0, \\t1\n"
+    "next\\@:\n"
+    ".endm\n"
+    "\n"
+    "; return addresses are pushed on segment r1 at index r2\n"
+    ".macro call target, t\n"
+    "        lv \\t, back\\@\n"
+    "        sstore r1, r2, \\t\n"
+    "        add r2, r2, r7\n"
+    "        lv \\t, \\target\n"
+    "        loadp r0, \\t\n"
+    "back\\@:\n"
+    ".endm\n"
+    "\n"
+    ".macro ret t\n"
+    "        add r2, r2, r6\n"
+    "        sload \\t, r1, r2\n"
+    "        loadp r0, \\t\n"
+    ".endm\n"
+    "\n"
+    "; writes length words of segment 0 from text on; seg must be a\n"
+    "; register other than r0 that holds 0\n"
+    ".macro print text, length, seg, idx, cnt, val, tmp\n"
+    "        lv \\seg, 0\n"
+    "        lv \\idx, \\text\n"
+    "        lv \\cnt, \\length\n"
+    "loop\\@: sload \\val, \\seg, \\idx\n"
+    "        out \\val\n"
+    "        add \\idx, \\idx, r7\n"
+    "        add \\cnt, \\cnt, r6\n"
+    "        loop_while \\cnt, loop\\@, \\val, \\tmp\n"
+    ".endm\n"
+    "\n"
+    "; counts down the word at label in segment 0 into cnt\n"
+    ".macro count_down label, cnt, t\n"
+    "        lv \\t, \\label\n"
+    "        sload \\cnt, r0, \\t\n"
+    "        add \\cnt, \\cnt, r6\n"
+    "        sstore r0, \\t, \\cnt\n"
+    ".endm\n"
+    "\n";
+
+/*
+* Name: epilogue
+* Summary: prints the code that writes "<name> done\n" and halts, and the
+*          message itself.
+*/
+static void epilogue(const char *name)
+{
+    printf("        print message, message_end - message, "
+           "r1, r2, r3, r4, r5\n"
+           "        halt\n"
+           "message: .string \"%s done\\n\"\n"
+           "message_end:\n", name);
+}
+
+static void alu(uint32_t *params)
+{
+    printf(".equ ITERATIONS, %u\n"
+           "        setup\n"
+           "        lv r1, ITERATIONS\n"
+           "        lv r2, 1\n"
+           "        lv r3, 40503\n"
+           "loop:   add r2, r2, r3\n"
+           "        mul r2, r2, r3\n"
+           "        nand r4, r2, r3\n"
+           "        div r5, r4, r3\n"
+           "        add r2, r2, r5\n"
+           "        add r1, r1, r6\n"
+           "        loop_while r1, loop, r4, r5\n"
+           "        lv r4, 255\n"
+           "        nand r5, r2, r4\n"
+           "        nand r5, r5, r5\n"
+           "        out r5\n"
+           "        lv r5, '\\n'\n"
+           "        out r5\n", params[0]);
+    epilogue("alu");
+}
+
+static void churn(uint32_t *params)
+{
+    printf(".equ DEPTH, %u\n"
+           ".equ SIZE, %u\n"
+           "        setup\n"
+           "        lv r3, DEPTH\n"
+           "        map r1, r3\n"
+           "round:  lv r2, DEPTH\n"
+           "fill:   add r2, r2, r6\n"
+           "        lv r3, SIZE\n"
+           "        map r4, r3\n"
+           "        sstore r4, r0, r2\n"
+           "        sstore r1, r2, r4\n"
+           "        loop_while r2, fill, r4, r3\n"
+           "        lv r2, DEPTH\n"
+           "drain:  add r2, r2, r6\n"
+           "        sload r4, r1, r2\n"
+           "        unmap r4\n"
+           "        loop_while r2, drain, r4, r3\n"
+           "        count_down rounds, r5, r4\n"
+           "        loop_while r5, round, r4, r3\n"
+           "        unmap r1\n", params[0], params[2]);
+    epilogue("churn");
+    printf("rounds: .word %u\n", params[1]);
+}
+
+static void recurse(uint32_t *params)
+{
+    printf(".equ DEPTH, %u\n"
+           "        setup\n"
+           "        lv r3, DEPTH\n"
+           "        add r3, r3, r7\n"
+           "        map r1, r3\n"
+           "        lv r2, 0\n"
+           "outer:  lv r3, DEPTH\n"
+           "        call rec, r5\n"
+           "        count_down repeat, r4, r5\n"
+           "        loop_while r4, outer, r5, r3\n"
+           "        unmap r1\n", params[0]);
+    epilogue("recurse");
+    printf("rec:    loop_while r3, deeper, r5, r4\n"
+           "        ret r5\n"
+           "deeper: add r3, r3, r6\n"
+           "        call rec, r5\n"
+           "        ret r5\n"
+           "repeat: .word %u\n", params[1]);
+}
+
+static void flood(uint32_t *params)
+{
+    printf("        setup\n"
+           "line:   print text, text_end - text, r1, r2, r3, r4, r5\n"
+           "        count_down lines, r1, r2\n"
+           "        loop_while r1, line, r2, r3\n");
+    epilogue("flood");
+    printf("text:   .string \"the quick brown fox jumps over the lazy "
+           "dog 0123456789\\n\"\n"
+           "text_end:\n"
+           "lines:  .word %u\n", params[0]);
+}
+
+static void copy(uint32_t *params)
+{
+    printf(".equ WORDS, %u\n"
+           "        setup\n"
+           "        lv r3, WORDS\n"
+           "        map r1, r3\n"
+           "        map r2, r3\n"
+           "again:  lv r3, WORDS\n"
+           "loop:   add r3, r3, r6\n"
+           "        sload r4, r1, r3\n"
+           "        sstore r2, r3, r4\n"
+           "        loop_while r3, loop, r4, r5\n"
+           "        count_down repeat, r3, r4\n"
+           "        loop_while r3, again, r4, r5\n"
+           "        unmap r2\n"
+           "        unmap r1\n", params[0]);
+    epilogue("copy");
+    printf("repeat: .word %u\n", params[1]);
+}
+
+static void echo(uint32_t *params)
+{
+    (void) params;
+    printf("        setup\n"
+           "loop:   in r1\n"
+           "        add r2, r1, r7\n"
+           "        loop_while r2, write, r3, r4\n");
+    epilogue("echo");
+    printf("write:  out r1\n"
+           "        lv r3, loop\n"
+           "        loadp r0, r3\n");
+}
+
+static const struct Workload {
+    const char *name;
+    int required;
+    int optional;
+    uint32_t defaults[3];
+    void (*emit)(uint32_t *params);
+    const char *usage;
+} workloads[] = {
+    { "alu",     1, 0, { 0, 0, 0 }, alu,     "alu <iterations>" },
+    { "churn",   2, 1, { 0, 0, 1 }, churn,
+      "churn <depth> <rounds> [size]" },
+    { "recurse", 2, 0, { 0, 0, 0 }, recurse, "recurse <depth> <repeat>" },
+    { "flood",   1, 0, { 0, 0, 0 }, flood,   "flood <lines>" },
+    { "copy",    2, 0, { 0, 0, 0 }, copy,    "copy <words> <repeat>" },
+    { "echo",    0, 0, { 0, 0, 0 }, echo,    "echo" }
+};
+
+static const int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./umgen <workload> <params...> \n");
+    for (int i = 0; i < num_workloads; i++) {
+        fprintf(stderr, "    %s\n", workloads[i].usage);
+    }
+    fprintf(stderr, "Every parameter is between 1 and %d\n", PARAM_MAX);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        usage();
+    }
+
+    const struct Workload *workload = NULL;
+    for (int i = 0; i < num_workloads; i++) {
+        if (strcmp(argv[1], workloads[i].name) == 0) {
+            workload = &workloads[i];
+        }
+    }
+    int count = argc - 2;
+    if (workload == NULL || count < workload -> required
+        || count > workload -> required + workload -> optional) {
+        usage();
+    }
+
+    uint32_t params[3];
+    memcpy(params, workload -> defaults, sizeof(params));
+    for (int i = 0; i < count; i++) {
+        char *end;
+        errno = 0;
+        unsigned long value = strtoul(argv[i + 2], &end, 10);
+        if (errno != 0 || *end != '\0' || value == 0 || value > PARAM_MAX) {
+            usage();
+        }
+        params[i] = value;
+    }
+
+    printf("%s", prelude);
+    workload -> emit(params);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/*
+*                       umstat.c
+*
+*
+*   Summary: umstat.c holds the main for umstat, which attaches to a guest
+*            run with ./um --stats by process id and prints a line per
+*            interval with its instruction rate, program counter, live
+*            segments, mapped bytes and map/unmap rates. A guest whose
+*            rate drops to 0 while running is stuck; high map and unmap
+*            rates with flat mapped bytes point to a thrashing allocator.
+*
+*   Authors: vmccab01 and pdlami01
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "metrics.h"
+
+static const char *states[] = { "running", "input", "halted" };
+
+static double seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double rate(uint64_t now, uint64_t before, double elapsed)
+{
+    return elapsed > 0 ? (now - before) / elapsed : 0;
+}
+
+/*
+* Name: print_line
+* Summary: prints one line comparing snapshot now with snapshot before,
+*          taken elapsed seconds apart.
+*/
+static void print_line(double at, struct Metrics_block *now,
+                       struct Metrics_block *before, double elapsed)
+{
+    const char *state = now -> state <= METRICS_HALTED
+                        ? states[now -> state] : "?";
+
+    printf("%8.1f %14" PRIu64 " %10.2f %10" PRIu64 " %9" PRIu64
+           " %12" PRIu64 " %10.0f %10.0f %6" PRIu64 " %s\n",
+           at, now -> instructions,
+           rate(now -> instructions, before -> instructions, elapsed) / 1e6,
+           now -> pc, now -> segments, now -> mapped_bytes / 1024,
+           rate(now -> maps, before -> maps, elapsed),
+           rate(now -> unmaps, before -> unmaps, elapsed),
+           now -> loads, state);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: ./umstat <pid> [seconds] \n");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = (pid_t) strtol(argv[1], NULL, 10);
+    double interval = argc == 3 ? strtod(argv[2], NULL) : 1.0;
+    if (interval <= 0) {
+        interval = 1.0;
+    }
+
+    const struct Metrics_block *block = metrics_attach(pid);
+    if (block == NULL) {
+        fprintf(stderr, "No guest with --stats running as %ld\n",
+                (long) pid);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%8s %14s %10s %10s %9s %12s %10s %10s %6s %s\n",
+           "time", "instructions", "Minstr/s", "pc", "segments",
+           "mapped_kb", "maps/s", "unmaps/s", "loads", "state");
+
+    struct Metrics_block before, now;
+    metrics_read(block, &before);
+    double start = seconds();
+    double last = start;
+
+    struct timespec pause;
+    pause.tv_sec = (time_t) interval;
+    pause.tv_nsec = (long) ((interval - pause.tv_sec) * 1e9);
+
+    for (;;) {
+        nanosleep(&pause, NULL);
+        metrics_read(block, &now);
+        double at = seconds();
+        print_line(at - start, &now, &before, at - last);
+
+        if (now.state == METRICS_HALTED) {
+            break;
+        }
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            printf("guest %ld exited without halting\n", (long) pid);
+            metrics_unlink(pid);
+            break;
+        }
+        before = now;
+        last = at;
+    }
+
+    metrics_detach(block);
+    return EXIT_SUCCESS;
+}